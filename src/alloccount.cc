@@ -0,0 +1,63 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "./alloccount.h"
+
+#include <cstdlib>
+#include <new>
+
+namespace {
+// This is a plain integer so that it needs no construction, which could
+// itself allocate, before the first call to operator new on a thread.
+thread_local uint64_t allocations = 0;
+
+void *Allocate(std::size_t size) {
+  allocations++;
+  void *ptr = std::malloc(size ? size : 1);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+}  // namespace
+
+void *operator new(std::size_t size) { return Allocate(size); }
+
+void *operator new[](std::size_t size) { return Allocate(size); }
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  allocations++;
+  return std::malloc(size ? size : 1);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+  allocations++;
+  return std::malloc(size ? size : 1);
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+
+void operator delete[](void *ptr) noexcept { std::free(ptr); }
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+  std::free(ptr);
+}
+
+namespace pyflame {
+uint64_t ThreadAllocations() { return allocations; }
+}  // namespace pyflame
@@ -0,0 +1,25 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+
+namespace pyflame {
+// The number of heap allocations made by the calling thread so far. Every
+// operator new in the program is counted, which is cheap enough to leave on;
+// --stats uses it to check that sampling doesn't allocate once it has warmed
+// up.
+uint64_t ThreadAllocations();
+}  // namespace pyflame
@@ -0,0 +1,73 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "./codecache.h"
+
+#include <algorithm>
+
+#include "./stringtable.h"
+
+namespace pyflame {
+void LineTable::Reset(int firstlineno) {
+  decoded_ = false;
+  firstlineno_ = firstlineno;
+  entries_.clear();
+  entries_.push_back({0, firstlineno});
+}
+
+void LineTable::Add(int addr_incr, int line_incr) {
+  Entry &last = entries_.back();
+  if (addr_incr == 0) {
+    // Large line number jumps are encoded as several pairs with a zero address
+    // increment; fold them into a single entry.
+    last.line += line_incr;
+  } else {
+    entries_.push_back({last.addr + addr_incr, last.line + line_incr});
+  }
+}
+
+int LineTable::Lookup(int lasti) const {
+  // f_lasti is -1 before the first instruction has executed.
+  if (lasti < 0 || entries_.empty()) {
+    return firstlineno_;
+  }
+  auto it = std::upper_bound(
+      entries_.begin(), entries_.end(), lasti,
+      [](int addr, const Entry &entry) { return addr < entry.addr; });
+  return (it - 1)->line;
+}
+
+CodeInfo *CodeCache::Find(unsigned long code_addr, const CodeId &id) {
+  auto it = entries_.find(code_addr);
+  if (it == entries_.end() || it->second.id != id) {
+    return nullptr;
+  }
+  return &it->second;
+}
+
+CodeInfo *CodeCache::Insert(unsigned long code_addr, const CodeId &id,
+                            const std::string &file, const std::string &name) {
+  if (entries_.size() >= MAX_CODE_CACHE_ENTRIES) {
+    Clear();
+  }
+  CodeInfo &info = entries_[code_addr];
+  info.id = id;
+  info.file_id = Strings().Intern(file);
+  info.name_id = Strings().Intern(name);
+  info.lines.Reset(id.firstlineno);
+  return &info;
+}
+
+void CodeCache::Clear() { entries_.clear(); }
+}  // namespace pyflame
@@ -0,0 +1,122 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Maximum number of code objects to remember for a single process. If a process
+// generates more than this many distinct code objects, the cache is flushed.
+#define MAX_CODE_CACHE_ENTRIES 65536
+
+// Maximum size of a co_lnotab, in bytes. Each entry takes two bytes, so this
+// is far more than even a generated function needs; a larger size is assumed to
+// be garbage.
+#define MAX_LINE_TABLE_SIZE (1 << 20)
+
+namespace pyflame {
+
+// A decoded co_lnotab, as a sorted array of (bytecode offset, line number)
+// pairs. Each entry gives the line number for bytecode offsets from addr up to
+// the addr of the next entry.
+class LineTable {
+ public:
+  LineTable() : decoded_(false), firstlineno_(0) {}
+
+  // Start a new table; the line number for offset 0 is firstlineno.
+  void Reset(int firstlineno);
+
+  // Append an (addr, line) increment pair from co_lnotab.
+  void Add(int addr_incr, int line_incr);
+
+  // Mark the table as complete.
+  inline void Finish() { decoded_ = true; }
+
+  inline bool decoded() const { return decoded_; }
+
+  // Get the line number for the bytecode offset lasti.
+  int Lookup(int lasti) const;
+
+ private:
+  struct Entry {
+    int addr;
+    int line;
+  };
+
+  bool decoded_;
+  int firstlineno_;
+  std::vector<Entry> entries_;
+};
+
+// The remote pointers that identify a code object. Code objects are immutable,
+// so as long as these still match an entry is valid; if they don't, the address
+// has been reused by a different code object.
+struct CodeId {
+  unsigned long filename_addr;
+  unsigned long name_addr;
+  unsigned long lnotab_addr;
+  int firstlineno;
+
+  inline bool operator==(const CodeId &other) const {
+    return filename_addr == other.filename_addr &&
+           name_addr == other.name_addr && lnotab_addr == other.lnotab_addr &&
+           firstlineno == other.firstlineno;
+  }
+  inline bool operator!=(const CodeId &other) const {
+    return !(*this == other);
+  }
+};
+
+// The decoded symbol information for a PyCodeObject in the target process.
+struct CodeInfo {
+  CodeId id;
+
+  // The ids of co_filename and co_name in the string table.
+  uint32_t file_id;
+  uint32_t name_id;
+
+  // The decoded co_lnotab. This is filled in lazily, the first time a line
+  // number is needed for the code object.
+  LineTable lines;
+};
+
+// Cache of decoded code objects, keyed by the remote address of the
+// PyCodeObject. Even a large, long running server only has a few thousand code
+// objects, so in the steady state decoding a frame doesn't need to read any
+// strings out of the target.
+class CodeCache {
+ public:
+  CodeCache() {}
+  CodeCache(const CodeCache &other) = delete;
+
+  // Get the entry for the code object at code_addr, or nullptr if there is no
+  // entry or the entry is stale.
+  CodeInfo *Find(unsigned long code_addr, const CodeId &id);
+
+  // Add (or replace) the entry for the code object at code_addr.
+  CodeInfo *Insert(unsigned long code_addr, const CodeId &id,
+                   const std::string &file, const std::string &name);
+
+  inline size_t size() const { return entries_.size(); }
+
+  void Clear();
+
+ private:
+  std::unordered_map<unsigned long, CodeInfo> entries_;
+};
+}  // namespace pyflame
@@ -0,0 +1,41 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "./errorlog.h"
+
+namespace pyflame {
+ErrorLog::ErrorLog(std::ostream *out)
+    : out_(out), written_(false), dropped_(0) {}
+
+std::ostream *ErrorLog::Report() {
+  const auto now = std::chrono::steady_clock::now();
+  if (written_ &&
+      now - last_ < std::chrono::milliseconds(ERROR_LOG_INTERVAL_MS)) {
+    dropped_++;
+    return nullptr;
+  }
+  Flush();
+  written_ = true;
+  last_ = now;
+  return out_;
+}
+
+void ErrorLog::Flush() {
+  if (dropped_) {
+    *out_ << "(" << dropped_ << " more error"
+          << (dropped_ == 1 ? "" : "s") << " not shown)\n";
+    dropped_ = 0;
+  }
+}
+}  // namespace pyflame
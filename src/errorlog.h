@@ -0,0 +1,49 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+// Minimum time between error messages from the sampling loop, in milliseconds.
+#define ERROR_LOG_INTERVAL_MS 1000
+
+namespace pyflame {
+
+// Rate limits the error messages written while sampling, so that a process
+// that fails on every sample doesn't flood stderr, and the sampling loop
+// doesn't spend its time formatting messages. At most one message is written
+// per ERROR_LOG_INTERVAL_MS; the ones in between are counted, and the count is
+// written before the next message that gets through.
+class ErrorLog {
+ public:
+  explicit ErrorLog(std::ostream *out);
+  ErrorLog(const ErrorLog &other) = delete;
+
+  // Report an error. Returns the stream to write the message to, or nullptr if
+  // the message should be dropped, in which case it's only counted.
+  std::ostream *Report();
+
+  // Write the number of messages dropped since the last one was written.
+  void Flush();
+
+ private:
+  std::ostream *out_;
+  bool written_;
+  std::chrono::steady_clock::time_point last_;
+  uint64_t dropped_;
+};
+}  // namespace pyflame
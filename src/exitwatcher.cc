@@ -0,0 +1,78 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "./exitwatcher.h"
+
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "./posix.h"
+
+// pidfd_open(2) has the same number on every architecture, but older headers
+// don't define it.
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+namespace pyflame {
+ExitWatcher::ExitWatcher() : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)) {}
+
+ExitWatcher::~ExitWatcher() {
+  for (const auto &entry : pidfds_) {
+    Close(entry.second);
+  }
+  Close(epoll_fd_);
+}
+
+bool ExitWatcher::Add(pid_t pid) {
+  if (epoll_fd_ == -1) {
+    return false;
+  }
+  const int fd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+  if (fd == -1) {
+    return false;
+  }
+  epoll_event event{};
+  event.events = EPOLLIN;
+  event.data.u32 = static_cast<uint32_t>(pid);
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) == -1) {
+    Close(fd);
+    return false;
+  }
+  pidfds_[pid] = fd;
+  events_.resize(pidfds_.size());
+  return true;
+}
+
+void ExitWatcher::Poll(std::vector<pid_t> *exited) {
+  exited->clear();
+  if (pidfds_.empty()) {
+    return;
+  }
+  const int n = epoll_wait(epoll_fd_, events_.data(),
+                           static_cast<int>(pidfds_.size()), 0);
+  for (int i = 0; i < n; i++) {
+    const pid_t pid = static_cast<pid_t>(events_[i].data.u32);
+    auto it = pidfds_.find(pid);
+    if (it == pidfds_.end()) {
+      continue;
+    }
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, it->second, nullptr);
+    Close(it->second);
+    pidfds_.erase(it);
+    exited->push_back(pid);
+  }
+}
+}  // namespace pyflame
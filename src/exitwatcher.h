@@ -0,0 +1,51 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <sys/epoll.h>
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace pyflame {
+
+// Detects when processes exit, using a pidfd for each process and an epoll set
+// to poll all of them at once. A pidfd becomes readable when the process exits,
+// whether or not it's traced, so a process that has gone away is noticed
+// without having to signal it or to wait on it.
+class ExitWatcher {
+ public:
+  ExitWatcher();
+  ExitWatcher(const ExitWatcher &other) = delete;
+  ~ExitWatcher();
+
+  // Start watching pid. Returns false if the kernel doesn't support pidfds (it
+  // needs Linux 5.3), in which case exits have to be detected some other way.
+  bool Add(pid_t pid);
+
+  // Replace the contents of exited with the watched processes that have exited
+  // since the last call, without blocking. A process is only reported once.
+  // This is called on every tick, so it doesn't allocate.
+  void Poll(std::vector<pid_t> *exited);
+
+ private:
+  int epoll_fd_;
+  std::unordered_map<pid_t, int> pidfds_;
+  std::vector<epoll_event> events_;  // One per watched process
+};
+}  // namespace pyflame
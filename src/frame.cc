@@ -15,16 +15,29 @@
 #include "./frame.h"
 
 namespace pyflame {
+const Frame &TruncatedFrame() {
+  static const Frame truncated("(truncated)", "", 0);
+  return truncated;
+}
+
 std::ostream &operator<<(std::ostream &os, const Frame &frame) {
-  os << frame.file() << ':' << frame.name() << ':' << frame.line();
+  print_frame(os, frame);
   return os;
 }
 
 void print_frame(std::ostream &os, const Frame &frame) {
+  if (frame == TruncatedFrame()) {
+    os << frame.file();
+    return;
+  }
   os << frame.file() << ':' << frame.name() << ':' << frame.line();
 }
 
 void print_frame_without_line_number(std::ostream &os, const Frame &frame) {
+  if (frame == TruncatedFrame()) {
+    os << frame.file();
+    return;
+  }
   os << frame.file() << ':' << frame.name();
 }
 }  // namespace pyflame
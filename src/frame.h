@@ -17,37 +17,60 @@
 #include <sys/types.h>
 
 #include <chrono>
+#include <cstdint>
 #include <functional>
 #include <ostream>
 #include <string>
 #include <vector>
 
 #include "./namespace.h"
+#include "./stringtable.h"
 
 namespace pyflame {
 
+// How much detail to record for each frame. Less detail means less work while
+// the target is stopped: in particular, without line numbers the line number
+// table of a code object is never read.
+enum class FrameDetail {
+  Function,    // File and function name only
+  Line,        // File, function name, and line number
+  ByteOffset,  // File, function name, and bytecode offset (f_lasti)
+};
+
+// A frame of a stack. The file and function names are ids in the process-wide
+// string table, so a frame is small and cheap to copy, hash, and compare.
 class Frame {
  public:
   Frame() = delete;
-  Frame(const Frame &other)
-      : file_(other.file_), name_(other.name_), line_(other.line_) {}
+  Frame(uint32_t file_id, uint32_t name_id, size_t line)
+      : file_id_(file_id),
+        name_id_(name_id),
+        line_(static_cast<uint32_t>(line)) {}
   Frame(const std::string &file, const std::string &name, size_t line)
-      : file_(file), name_(name), line_(line) {}
+      : Frame(Strings().Intern(file), Strings().Intern(name), line) {}
 
-  inline const std::string &file() const { return file_; }
-  inline const std::string &name() const { return name_; }
+  inline const std::string &file() const { return Strings().Lookup(file_id_); }
+  inline const std::string &name() const { return Strings().Lookup(name_id_); }
+  inline uint32_t file_id() const { return file_id_; }
+  inline uint32_t name_id() const { return name_id_; }
   inline size_t line() const { return line_; }
 
   inline bool operator==(const Frame &other) const {
-    return file_ == other.file_ && line_ == other.line_;
+    return file_id_ == other.file_id_ && name_id_ == other.name_id_ &&
+           line_ == other.line_;
   }
 
  private:
-  std::string file_;
-  std::string name_;
-  size_t line_;
+  uint32_t file_id_;
+  uint32_t name_id_;
+  uint32_t line_;
 };
 
+// Stands in for the outer frames of a stack that could only be partly read,
+// e.g. because a frame was freed while the stack was walked. It's printed as
+// just "(truncated)".
+const Frame &TruncatedFrame();
+
 std::ostream &operator<<(std::ostream &os, const Frame &frame);
 void print_frame(std::ostream &os, const Frame &frame);
 void print_frame_without_line_number(std::ostream &os, const Frame &frame);
@@ -57,17 +80,20 @@ typedef std::vector<Frame> frames_t;
 
 struct FrameHash {
   size_t operator()(const frames_t &frames) const {
-    size_t hash = 0;
-    for (size_t i = 0; i < frames.size(); i++) {
-      hash ^= std::hash<size_t>()(i);
-      hash ^= std::hash<std::string>()(frames[i].file());
+    uint64_t hash = frames.size();
+    for (const auto &frame : frames) {
+      hash = (hash ^ frame.file_id()) * 0x100000001b3ULL;
+      hash = (hash ^ frame.name_id()) * 0x100000001b3ULL;
+      hash = (hash ^ frame.line()) * 0x100000001b3ULL;
     }
-    return hash;
+    return static_cast<size_t>(hash);
   }
 };
 
 struct FrameTS {
   std::chrono::system_clock::time_point ts;
   frames_t frames;
+  pid_t pid;    // The process the stack was sampled from
+  bool failed;  // The sample failed, and frames is empty
 };
 }  // namespace pyflame
@@ -25,18 +25,27 @@
 
 #include <sys/types.h>
 #include <algorithm>
+#include <cerrno>
+#include <chrono>
 #include <cstddef>
+#include <exception>
 #include <fstream>
 #include <iostream>
-#include <limits>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <utility>
+#include <vector>
 
+#include "./codecache.h"
 #include "./config.h"
 #include "./exc.h"
 #include "./ptrace.h"
 #include "./pyfrob.h"
+#include "./remote.h"
 #include "./symbol.h"
+#include "./threadcache.h"
+#include "./utf8.h"
 
 // why would this not be true idk
 static_assert(sizeof(long) == sizeof(void *), "wat platform r u on");
@@ -53,20 +62,34 @@ unsigned long ByteData(unsigned long addr) {
   return addr + offsetof(PyStringObject, ob_sval);
 }
 
-std::string StringData(pid_t pid, unsigned long addr) {
-  return PtracePeekString(pid, ByteData(addr));
+// Python 2 strings carry their length, so the data can be copied with a single
+// read of a known size rather than by scanning for the NUL terminator.
+std::string StringData(RemoteMemory *mem, unsigned long addr) {
+  Py_ssize_t size;
+  mem->ReadValue(StringSize(addr), &size);
+  if (size < 0 || size > MAX_STRING_LENGTH) {
+    std::ostringstream ss;
+    ss << "Bad string size " << size << " at "
+       << reinterpret_cast<void *>(addr);
+    throw PtraceException(ss.str());
+  }
+  std::string str(static_cast<size_t>(size), '\0');
+  if (size) {
+    mem->Read(ByteData(addr), &str[0], str.size());
+  }
+  return str;
 }
 
 #elif PYFLAME_PY_VERSION == 34
 namespace py34 {
-std::string StringDataPython3(pid_t pid, unsigned long addr);
+std::string StringDataPython3(RemoteMemory *mem, unsigned long addr);
 
 unsigned long StringSize(unsigned long addr) {
   return addr + offsetof(PyVarObject, ob_size);
 }
 
-std::string StringData(pid_t pid, unsigned long addr) {
-  return StringDataPython3(pid, addr);
+std::string StringData(RemoteMemory *mem, unsigned long addr) {
+  return StringDataPython3(mem, addr);
 }
 
 unsigned long ByteData(unsigned long addr) {
@@ -75,14 +98,14 @@ unsigned long ByteData(unsigned long addr) {
 
 #elif PYFLAME_PY_VERSION == 36
 namespace py36 {
-std::string StringDataPython3(pid_t pid, unsigned long addr);
+std::string StringDataPython3(RemoteMemory *mem, unsigned long addr);
 
 unsigned long StringSize(unsigned long addr) {
   return addr + offsetof(PyVarObject, ob_size);
 }
 
-std::string StringData(pid_t pid, unsigned long addr) {
-  return StringDataPython3(pid, addr);
+std::string StringData(RemoteMemory *mem, unsigned long addr) {
+  return StringDataPython3(mem, addr);
 }
 
 unsigned long ByteData(unsigned long addr) {
@@ -94,22 +117,29 @@ static_assert(false, "uh oh, bad PYFLAME_PY_VERSION");
 #endif
 
 #if PYFLAME_PY_VERSION >= 34
-std::string StringDataPython3(pid_t pid, unsigned long addr) {
+// Give up on the string object at addr, which isn't a valid compact string.
+void BadString(unsigned long addr, const PyASCIIObject *unicode) {
+  std::ostringstream ss;
+  ss << "Bad string (length " << unicode->length << ", kind "
+     << unicode->state.kind << ", compact " << unicode->state.compact
+     << ") at " << reinterpret_cast<void *>(addr);
+  throw PtraceException(ss.str());
+}
+
+std::string StringDataPython3(RemoteMemory *mem, unsigned long addr) {
   // TODO: This function only works for Python >= 3.3. Is it also possible to
   // support older versions of Python 3?
 
   // TODO: Can we guarantee that the same padding is used for the bitfield?
-  const std::unique_ptr<uint8_t[]> unicode_bytes =
-      PtracePeekBytes(pid, addr, sizeof(PyASCIIObject));
-  PyASCIIObject *unicode =
-      reinterpret_cast<PyASCIIObject *>(unicode_bytes.get());
+  PyASCIIObject ascii_object;
+  mem->ReadValue(addr, &ascii_object);
+  const PyASCIIObject *unicode = &ascii_object;
 
   // Because both the filename and function name string objects are made by the
   // Python interpreter itself, we can probably assume they are compact. This
   // means that the data immediately follows the object, and is of type {ASCII,
-  // Latin-1, UCS-2, UCS-4}.
-  assert(unicode->state.compact);
-
+  // Latin-1, UCS-2, UCS-4}. A string that isn't is most likely garbage, from
+  // reading an object that was freed while the process was running.
   const long str_offset = unicode->state.ascii ? sizeof(PyASCIIObject)
                                                : sizeof(PyCompactUnicodeObject);
 
@@ -118,136 +148,443 @@ std::string StringDataPython3(pid_t pid, unsigned long addr) {
   // outlined in PEP 393, which still had only two bits allocated to the kind
   // field.
   const unsigned int ch_size = unicode->state.kind;
-  const ssize_t str_length = ch_size * unicode->length;
-  const std::unique_ptr<uint8_t[]> bytes =
-      PtracePeekBytes(pid, addr + str_offset, str_length);
-
-  std::ostringstream dump;
-
-  for (int i = 0; i < str_length; i += ch_size) {
-    Py_UCS4 ch = 0;
-
-    switch (unicode->state.kind) {
-      case PyUnicode_1BYTE_KIND:
-        ch = bytes[i];
-        break;
-      case PyUnicode_2BYTE_KIND: {
-        Py_UCS2 *data_2 = reinterpret_cast<Py_UCS2 *>(&bytes.get()[i]);
-        ch = *data_2;
-        break;
-      }
-      case PyUnicode_4BYTE_KIND: {
-        Py_UCS4 *data_4 = reinterpret_cast<Py_UCS4 *>(&bytes.get()[i]);
-        ch = *data_4;
-        break;
-      }
-      default:
-        // We are not supposed to come here, as the WCHAR kind is not supported
-        // when the object is compact.
-        assert(false);
-        break;
-    }
-
-    // TODO: Is it alright to assume a lack of surrogates. They might be present
-    // in the UCS-2 representation if the UTF-16 approach is used. We currently
-    // assume that CPython will instead use UCS-4 for such characters, instead
-    // of using surrogates.
-
-    // Below section is taken from CPython's STRINGLIB(utf8_encoder) routine.
-    // The differences are that (1) we use a string builder instead of a char
-    // buffer, and (2) that we skip the surrogate handling entirely.
-    if (ch < 0x80) {
-      /* Encode ASCII */
-      dump << (char)ch;
-    } else if (ch < 0x0800) {
-      /* Encode Latin-1 */
-      dump << (char)(0xc0 | (ch >> 6));
-      dump << (char)(0x80 | (ch & 0x3f));
-    } else if (ch < 0x10000) {
-      dump << (char)(0xe0 | (ch >> 12));
-      dump << (char)(0x80 | ((ch >> 6) & 0x3f));
-      dump << (char)(0x80 | (ch & 0x3f));
-    } else {
-      /* ch >= 0x10000 */
-      assert(ch <= 0x10ffff);  // Maximum code point of Unicode 6.0
-
-      /* Encode UCS4 Unicode ordinals */
-      dump << (char)(0xf0 | (ch >> 18));
-      dump << (char)(0x80 | ((ch >> 12) & 0x3f));
-      dump << (char)(0x80 | ((ch >> 6) & 0x3f));
-      dump << (char)(0x80 | (ch & 0x3f));
+  if (!unicode->state.compact || unicode->length < 0 ||
+      unicode->length > MAX_STRING_LENGTH ||
+      (ch_size != 1 && ch_size != 2 && ch_size != 4)) {
+    BadString(addr, unicode);
+  }
+  std::string str;
+  if (unicode->state.ascii) {
+    // ASCII is already UTF-8, so it can be read straight into the result.
+    str.resize(unicode->length);
+    if (unicode->length) {
+      mem->Read(addr + str_offset, &str[0], str.size());
     }
+    return str;
   }
 
-  return dump.str();
+  // TODO: Is it alright to assume a lack of surrogates. They might be present
+  // in the UCS-2 representation if the UTF-16 approach is used. We currently
+  // assume that CPython will instead use UCS-4 for such characters, instead
+  // of using surrogates.
+  static thread_local std::vector<uint8_t> data;
+  data.resize(ch_size * unicode->length);
+  mem->Read(addr + str_offset, data.data(), data.size());
+  if (!EncodeUTF8(data.data(), unicode->length, ch_size, &str)) {
+    BadString(addr, unicode);
+  }
+  return str;
 }
 #endif
 
-// Extract the line number from the code object. Python uses a compressed table
-// data structure to store line numbers. See:
+// Remote address of a pointer that was read out of the target process.
+inline unsigned long RemoteAddr(const void *ptr) {
+  return reinterpret_cast<unsigned long>(ptr);
+}
+
+// The functions that read objects during the stack walk don't throw: a frame
+// that was freed while its stack was walked is an expected failure, and the
+// frames that were read before it are still kept. Instead they return false,
+// and record why in walker->error.
+bool WalkFailed(Walker *walker, const char *reason, unsigned long addr,
+                int err) {
+  walker->error = {reason, addr, err};
+  return false;
+}
+
+// Check that an object read from addr has the type at type_addr, if that is
+// known. If the process is running while it's read, a pointer that was read
+// may already be stale, and this catches most of the resulting garbage.
+bool CheckType(Walker *walker, const void *object, unsigned long addr,
+               unsigned long type_addr, const char *reason) {
+  if (type_addr != 0 && RemoteAddr(Py_TYPE(object)) != type_addr) {
+    return WalkFailed(walker, reason, addr, 0);
+  }
+  return true;
+}
+
+// Read the fixed size part of a frame object. Everything after f_iblock is the
+// block stack and the value stack, which are never needed here, so they're
+// skipped to keep the read small.
+bool ReadFrame(Walker *walker, unsigned long addr, PyFrameObject *frame) {
+  const int err =
+      walker->mem->TryRead(addr, frame, offsetof(PyFrameObject, f_iblock));
+  if (err) {
+    return WalkFailed(walker, "cannot read frame", addr, err);
+  }
+  return CheckType(walker, frame, addr, walker->state->frame_type,
+                   "not a frame");
+}
+
+bool ReadCode(Walker *walker, unsigned long addr, PyCodeObject *code) {
+  const int err = walker->mem->TryRead(addr, code, sizeof(*code));
+  if (err) {
+    return WalkFailed(walker, "cannot read code object", addr, err);
+  }
+  return CheckType(walker, code, addr, walker->state->code_type,
+                   "not a code object");
+}
+
+// Decode the co_lnotab bytes object at lnotab_addr into a line table. Python
+// uses a compressed table data structure to store line numbers. See:
 //
 // https://svn.python.org/projects/python/trunk/Objects/lnotab_notes.txt
 //
-// This is essentially an implementation of PyFrame_GetLineNumber /
-// PyCode_Addr2Line.
-size_t GetLine(pid_t pid, unsigned long frame, unsigned long f_code) {
-  const long f_trace = PtracePeek(pid, frame + offsetof(_frame, f_trace));
-  if (f_trace) {
-    return static_cast<size_t>(
-        PtracePeek(pid, frame + offsetof(_frame, f_lineno)) &
-        std::numeric_limits<decltype(_frame::f_lineno)>::max());
-  }
-
-  const int f_lasti = PtracePeek(pid, frame + offsetof(_frame, f_lasti)) &
-                      std::numeric_limits<int>::max();
-  const long co_lnotab =
-      PtracePeek(pid, f_code + offsetof(PyCodeObject, co_lnotab));
-
-  int size =
-      PtracePeek(pid, StringSize(co_lnotab)) & std::numeric_limits<int>::max();
-  int line = PtracePeek(pid, f_code + offsetof(PyCodeObject, co_firstlineno)) &
-             std::numeric_limits<int>::max();
-  const std::unique_ptr<uint8_t[]> tbl =
-      PtracePeekBytes(pid, ByteData(co_lnotab), size);
-  size /= 2;  // since we increment twice in each loop iteration
-  const uint8_t *p = tbl.get();
-  int addr = 0;
-  while (--size >= 0) {
-    addr += *p++;
-    if (addr > f_lasti) {
-      break;
+// The code object may have been freed, if the process is running, so its size
+// is checked before anything is allocated for it.
+void DecodeLineTable(RemoteMemory *mem, unsigned long lnotab_addr,
+                     LineTable *table) {
+  Py_ssize_t size;
+  mem->ReadValue(StringSize(lnotab_addr), &size);
+  if (size < 0 || size > MAX_LINE_TABLE_SIZE) {
+    std::ostringstream ss;
+    ss << "Bad line table size " << size << " at "
+       << reinterpret_cast<void *>(lnotab_addr);
+    throw PtraceException(ss.str());
+  }
+  static thread_local std::vector<uint8_t> tbl;
+  tbl.resize(static_cast<size_t>(size));
+  mem->Read(ByteData(lnotab_addr), tbl.data(), tbl.size());
+  for (size_t i = 0; i + 1 < tbl.size(); i += 2) {
+#if PYFLAME_PY_VERSION >= 36
+    // Since Python 3.6 the line number increments are signed.
+    table->Add(tbl[i], static_cast<int8_t>(tbl[i + 1]));
+#else
+    table->Add(tbl[i], tbl[i + 1]);
+#endif
+  }
+  table->Finish();
+}
+
+// Extract the line number for a frame. This is essentially an implementation of
+// PyFrame_GetLineNumber / PyCode_Addr2Line, except that the line table for each
+// code object is only decoded once. traced_lineno is f_lineno if the frame is
+// being traced (in which case f_lineno is kept up to date), or -1.
+size_t GetLine(RemoteMemory *mem, int lasti, int traced_lineno,
+               CodeInfo *info) {
+  if (traced_lineno >= 0) {
+    return static_cast<size_t>(traced_lineno);
+  }
+  if (!info->lines.decoded()) {
+    // Start over, in case an earlier attempt failed part way through.
+    info->lines.Reset(info->id.firstlineno);
+    DecodeLineTable(mem, info->id.lnotab_addr, &info->lines);
+  }
+  return static_cast<size_t>(info->lines.Lookup(lasti));
+}
+
+// Get the symbol information for the code object at code_addr. The strings are
+// only read out of the target the first time a code object is seen. The
+// caller must hold code_mutex.
+CodeInfo *LookupCode(Walker *walker, unsigned long code_addr,
+                     const PyCodeObject &code) {
+  FrobState *state = walker->state;
+  const CodeId id = {RemoteAddr(code.co_filename), RemoteAddr(code.co_name),
+                     RemoteAddr(code.co_lnotab), code.co_firstlineno};
+  CodeInfo *info = state->code_cache.Find(code_addr, id);
+  if (info == nullptr) {
+    info = state->code_cache.Insert(code_addr, id,
+                                    StringData(walker->mem, id.filename_addr),
+                                    StringData(walker->mem, id.name_addr));
+  }
+  return info;
+}
+
+// Decode a frame whose f_code is code_addr, at the position given by lasti and
+// traced_lineno (as for GetLine()), into frame. Returns false if the code
+// object can't be read.
+bool DecodeFrame(Walker *walker, unsigned long code_addr, int lasti,
+                 int traced_lineno, FrameDetail detail, Frame *frame) {
+  PyCodeObject code;
+  if (!ReadCode(walker, code_addr, &code)) {
+    return false;
+  }
+  size_t line = 0;
+  if (detail == FrameDetail::ByteOffset) {
+    line = static_cast<size_t>(std::max(lasti, 0));
+  }
+  std::lock_guard<std::mutex> lock(walker->state->code_mutex);
+  try {
+    // Only the first sight of a code object reads its strings and line table,
+    // so these still report errors by throwing.
+    CodeInfo *info = LookupCode(walker, code_addr, code);
+    if (detail == FrameDetail::Line) {
+      line = GetLine(walker->mem, lasti, traced_lineno, info);
     }
-    line += *p++;
+    *frame = {info->file_id, info->name_id, line};
+  } catch (const PtraceException &exc) {
+    return WalkFailed(walker, "cannot decode code object", code_addr, 0);
   }
-  return static_cast<size_t>(line);
+  return true;
+}
+
+// The flags of the code objects whose frames can be suspended and resumed:
+// generators, and from Python 3.5 on, coroutines and async generators.
+#if defined(CO_ASYNC_GENERATOR)
+const int kResumableFlags = CO_GENERATOR | CO_COROUTINE |
+                            CO_ITERABLE_COROUTINE | CO_ASYNC_GENERATOR;
+#elif defined(CO_COROUTINE)
+const int kResumableFlags =
+    CO_GENERATOR | CO_COROUTINE | CO_ITERABLE_COROUTINE;
+#else
+const int kResumableFlags = CO_GENERATOR;
+#endif
+
+// Check whether the frames of the code object at code_addr can be suspended and
+// resumed from another caller. If its flags can't be read, they're assumed to.
+bool IsResumable(Walker *walker, unsigned long code_addr) {
+  int flags;
+  return walker->mem->TryRead(code_addr + offsetof(PyCodeObject, co_flags),
+                              &flags, sizeof(flags)) != 0 ||
+         (flags & kResumableFlags) != 0;
 }
 
 // This method will fill the stack trace. Normally in the C API there are some
 // methods that you can use to extract the filename and line number from a frame
-// object. We implement the same logic here just using PTRACE_PEEKDATA. In
-// principle we could also execute code in the context of the process, but this
-// approach is harder to mess up.
-void FollowFrame(pid_t pid, unsigned long frame, std::vector<Frame> *stack) {
-  const long f_code = PtracePeek(pid, frame + offsetof(_frame, f_code));
-  const long co_filename =
-      PtracePeek(pid, f_code + offsetof(PyCodeObject, co_filename));
-  const std::string filename = StringData(pid, co_filename);
-  const long co_name =
-      PtracePeek(pid, f_code + offsetof(PyCodeObject, co_name));
-  const std::string name = StringData(pid, co_name);
-
-  stack->push_back({filename, name, GetLine(pid, frame, f_code)});
-
-  const long f_back = PtracePeek(pid, frame + offsetof(_frame, f_back));
-  if (f_back != 0) {
-    FollowFrame(pid, f_back, stack);
+// object. We implement the same logic here by reading the remote process
+// memory. In principle we could also execute code in the context of the
+// process, but this approach is harder to mess up.
+//
+// The frame and code objects are each copied out of the target with a single
+// read, and the fields are decoded from the local copies.
+//
+// The walk stops after max_depth frames, or if the f_back chain loops back on
+// itself, which should never happen in a healthy process but would otherwise
+// make us spin forever. Loops are detected with Brent's algorithm, so this
+// doesn't need any memory beyond the stack itself.
+//
+// If a frame can't be read, the frames before it are left in stack.
+//
+// If the walk reaches a frame that is unchanged since the previous sample of
+// the thread, and whose parent is unchanged too, the rest of the stack is
+// copied from the thread's cache instead of being read again. The parent is
+// checked because frame objects are recycled, so an address match alone
+// doesn't mean that the frame still has the same callers. The parent mustn't be
+// a generator or coroutine either: its f_back is re-linked each time it's
+// resumed, so it can be resumed from elsewhere in its caller while its own
+// f_lasti stays the same.
+WalkResult FollowFrame(Walker *walker, ThreadCache *cache,
+                       unsigned long frame_addr, FrameDetail detail,
+                       size_t max_depth, std::vector<Frame> *stack) {
+  stack->clear();
+  cache->Begin(detail);
+  unsigned long tortoise = frame_addr;
+  size_t power = 1, lambda = 0;
+
+  // Two frame buffers, so that a parent that was read to check the cache can
+  // be decoded without reading it again.
+  PyFrameObject frames[2];
+  PyFrameObject *frame = &frames[0];
+  bool have_frame = false;
+  while (frame_addr != 0) {
+    if (stack->size() >= max_depth) {
+      cache->Finish(*stack, false);
+      return WalkResult::Truncated;
+    }
+    if (!have_frame && !ReadFrame(walker, frame_addr, frame)) {
+      cache->Finish(*stack, false);
+      return WalkResult::Failed;
+    }
+    const unsigned long back_addr = RemoteAddr(frame->f_back);
+    const unsigned long code_addr = RemoteAddr(frame->f_code);
+    const FrameRecord record{frame_addr, back_addr, code_addr, frame->f_lasti,
+                             frame->f_lineno};
+
+    PyFrameObject *parent = frame == &frames[0] ? &frames[1] : &frames[0];
+    have_frame = false;
+    const ssize_t cached = cache->Find(record);
+    if (cached >= 0 && stack->size() + cache->size() - cached <= max_depth) {
+      bool unchanged = back_addr == 0;
+      if (!unchanged) {
+        // If the parent can't be read, the walk fails when it gets there.
+        have_frame = ReadFrame(walker, back_addr, parent);
+        unchanged =
+            have_frame &&
+            cache->Matches(cached + 1,
+                           {back_addr, RemoteAddr(parent->f_back),
+                            RemoteAddr(parent->f_code), parent->f_lasti,
+                            parent->f_lineno}) &&
+            !IsResumable(walker, RemoteAddr(parent->f_code));
+      }
+      if (unchanged) {
+        cache->Splice(cached, stack);
+        cache->Finish(*stack, true);
+        return WalkResult::Complete;
+      }
+    }
+
+    const int traced_lineno =
+        frame->f_trace != nullptr ? frame->f_lineno : -1;
+    if (walker->state->defer) {
+      // Leave a placeholder, to be decoded once the process is running again.
+      walker->pending.push_back(
+          {0, stack->size(), code_addr, frame->f_lasti, traced_lineno});
+      stack->push_back({0, 0, 0});
+    } else {
+      stack->push_back({0, 0, 0});
+      if (!DecodeFrame(walker, code_addr, frame->f_lasti, traced_lineno, detail,
+                       &stack->back())) {
+        stack->pop_back();
+        cache->Finish(*stack, false);
+        return WalkResult::Failed;
+      }
+    }
+    cache->Add(record);
+
+    frame_addr = back_addr;
+    frame = parent;
+    if (frame_addr == tortoise) {
+      cache->Finish(*stack, false);
+      return WalkResult::Truncated;
+    }
+    if (++lambda == power) {
+      tortoise = frame_addr;
+      power *= 2;
+      lambda = 0;
+    }
+  }
+  cache->Finish(*stack, true);
+  return WalkResult::Complete;
+}
+
+// Walk the stack of the thread whose PyThreadState is at tstate, starting at
+// frame_addr. If the process is running, the thread may call or return while
+// its stack is read, so some of the frames that were read may have been freed
+// and reused. If the thread's current frame changed during the walk, the walk
+// is retried; if it keeps changing, none of it is kept.
+WalkResult WalkThread(Walker *walker, ThreadCache *cache, unsigned long tstate,
+                      unsigned long frame_addr, FrameDetail detail,
+                      std::vector<Frame> *stack) {
+  const FrobState *state = walker->state;
+  const unsigned long frame_ptr = tstate + offsetof(PyThreadState, frame);
+  const size_t pending = walker->pending.size();
+  for (size_t attempt = 0;; attempt++) {
+    // Drop the frames left pending by an earlier attempt.
+    walker->pending.resize(pending);
+    const WalkResult result = FollowFrame(walker, cache, frame_addr, detail,
+                                          state->max_depth, stack);
+    if (!state->nonstop) {
+      return result;
+    }
+    unsigned long current;
+    const int err = walker->mem->TryRead(frame_ptr, &current, sizeof(current));
+    if (err == 0 && current == frame_addr) {
+      return result;
+    }
+    if (err != 0 || attempt >= MAX_NONSTOP_RETRIES) {
+      walker->pending.resize(pending);
+      stack->clear();
+      WalkFailed(walker,
+                 err ? "cannot read thread state"
+                     : "stack changed while it was being read",
+                 tstate, err);
+      return WalkResult::Failed;
+    }
+    frame_addr = current;
+  }
+}
+
+// Give up on a sample whose walk failed because the process has gone away, so
+// that the caller notices the exit. Any other failure only truncates a stack.
+void CheckExited(const FrobState &state, const WalkError &error) {
+  if (error.err == ESRCH) {
+    std::ostringstream ss;
+    ss << "Process " << state.mem.pid() << " exited: " << error;
+    throw PtraceException(ss.str());
+  }
+}
+
+// Record a stack that was cut short, after a walk failed with error.
+void CountTruncated(FrobState *state, const WalkError &error,
+                    std::vector<Frame> *stack) {
+  stack->push_back(TruncatedFrame());
+  state->truncated++;
+  state->error = error;
+  if (state->stats != nullptr) {
+    state->stats->truncated++;
+  }
+}
+
+// Walk the stacks in state->walks into the threads at the same indexes. With a
+// worker pool, and enough stacks to be worth waking it, the stacks are walked
+// in parallel. The pending frames of all of the walks end up in state->pending.
+//
+// A walk that throws doesn't take down the worker it ran on: the exception is
+// kept, and the first one, in thread order, is rethrown once every walk is
+// done.
+void WalkThreads(FrobState *state, FrameDetail detail, bool parallel,
+                 std::vector<Thread> *threads) {
+  parallel = parallel && state->pool != nullptr &&
+             state->walks.size() >= MIN_PARALLEL_WALKS;
+  for (const Walker &walker : state->walkers) {
+    parallel = parallel && walker.mem->concurrent();
+  }
+  const size_t workers = parallel ? state->pool->size() : 1;
+  while (state->walkers.size() < workers) {
+    RemoteMemory *mem = &state->mem;
+    if (!state->walkers.empty()) {
+      state->readers.emplace_back(state->mem.pid());
+      mem = &state->readers.back();
+    }
+    state->walkers.emplace_back(state, mem);
+  }
+  const bool timed = state->stats != nullptr;
+  const auto walk = [state, detail, threads, timed](size_t worker, size_t i) {
+    Walker *walker = &state->walkers[worker];
+    ThreadWalk *walk = &state->walks[i];
+    const size_t pending = walker->pending.size();
+    std::chrono::steady_clock::time_point start;
+    if (timed) {
+      start = std::chrono::steady_clock::now();
+    }
+    try {
+      walk->result = WalkThread(walker, walk->cache, walk->tstate, walk->frame,
+                                detail, (*threads)[i].mutable_frames());
+    } catch (...) {
+      walk->exception = std::current_exception();
+    }
+    if (timed) {
+      walk->time = std::chrono::steady_clock::now() - start;
+    }
+    walk->error = walker->error;
+    for (size_t j = pending; j < walker->pending.size(); j++) {
+      walker->pending[j].thread = i;
+    }
+  };
+  if (parallel) {
+    state->pool->Run(state->walks.size(), walk);
+  } else {
+    for (size_t i = 0; i < state->walks.size(); i++) {
+      walk(0, i);
+    }
+  }
+  for (Walker &walker : state->walkers) {
+    state->pending.insert(state->pending.end(), walker.pending.begin(),
+                          walker.pending.end());
+    walker.pending.clear();
+  }
+  for (const ThreadWalk &walk : state->walks) {
+    if (walk.exception) {
+      // The walk may have left its thread cache half updated.
+      state->pending.clear();
+      state->thread_caches.clear();
+      std::rethrow_exception(walk.exception);
+    }
   }
 }
 
 // N.B. To better understand how this method works, read the implementation of
 // pystate.c in the CPython source code.
-std::vector<Thread> GetThreads(pid_t pid, PyAddresses addrs,
-                               bool enable_threads) {
+void GetThreads(FrobState *state, PyAddresses addrs, bool enable_threads,
+                FrameDetail detail, std::vector<Thread> *threads) {
+  RemoteMemory *mem = &state->mem;
+  state->sample++;
+  if (!state->pending.empty()) {
+    // The previous sample was never resolved, so the thread caches have
+    // placeholders in place of the frames that were pending.
+    state->pending.clear();
+    state->thread_caches.clear();
+  }
   // Pointer to the current interpreter state. Python has a very rarely used
   // feature called "sub-interpreters", Pyflame only supports profiling a single
   // sub-interpreter.
@@ -256,12 +593,13 @@ std::vector<Thread> GetThreads(pid_t pid, PyAddresses addrs,
   // First try to get interpreter state via dereferencing
   // _PyThreadState_Current. This won't work if the main thread doesn't hold
   // the GIL (_Current will be null).
-  unsigned long tstate = PtracePeek(pid, addrs.tstate_addr);
-  unsigned long current_tstate = tstate;
+  unsigned long tstate = mem->ReadWord(addrs.tstate_addr);
+  const unsigned long current_tstate = tstate;
+  PyThreadState ts;
   if (enable_threads) {
     if (tstate != 0) {
-      istate = static_cast<unsigned long>(
-          PtracePeek(pid, tstate + offsetof(PyThreadState, interp)));
+      mem->ReadValue(tstate, &ts);
+      istate = RemoteAddr(ts.interp);
       // Secondly try to get it via the static interp_head symbol, if we managed
       // to find it:
       //  - interp_head is not strictly speaking part of the public API so it
@@ -270,7 +608,7 @@ std::vector<Thread> GetThreads(pid_t pid, PyAddresses addrs,
       //    will drop it
     } else if (addrs.interp_head_addr != 0) {
       istate =
-          static_cast<unsigned long>(PtracePeek(pid, addrs.interp_head_addr));
+          static_cast<unsigned long>(mem->ReadWord(addrs.interp_head_addr));
     } else if (addrs.interp_head_hint != 0) {
       // Finally. check if we have already put a hint into interp_head_hint -
       // currently this can only happen if we called PyInterpreterState_Head.
@@ -278,35 +616,122 @@ std::vector<Thread> GetThreads(pid_t pid, PyAddresses addrs,
     }
     if (istate != 0) {
       tstate = static_cast<unsigned long>(
-          PtracePeek(pid, istate + offsetof(PyInterpreterState, tstate_head)));
+          mem->ReadWord(istate + offsetof(PyInterpreterState, tstate_head)));
     }
   }
 
-  // Walk the thread list.
-  std::vector<Thread> threads;
+  // Walk the thread list, and make a note of the stack of each thread to walk.
+  // The Thread objects (and their frame vectors) from the previous sample are
+  // reused, so in the steady state this doesn't allocate.
+  state->walks.clear();
+  bool parallel = true;
+  size_t count = 0, visited = 0;
   while (tstate != 0) {
-    const unsigned long id =
-        PtracePeek(pid, tstate + offsetof(PyThreadState, thread_id));
+    if (++visited > MAX_THREADS) {
+      throw PtraceException("Too many threads; is the thread list corrupt?");
+    }
+    mem->ReadValue(tstate, &ts);
     const bool is_current = tstate == current_tstate;
 
     // Dereference the thread's current frame.
-    const unsigned long frame_addr = static_cast<unsigned long>(
-        PtracePeek(pid, tstate + offsetof(PyThreadState, frame)));
-
-    std::vector<Frame> stack;
-    if (frame_addr != 0) {
-      FollowFrame(pid, frame_addr, &stack);
-      threads.push_back(Thread(id, is_current, stack));
+    if (ts.frame != nullptr) {
+      if (count == threads->size()) {
+        if (state->spare_threads.empty()) {
+          threads->emplace_back();
+        } else {
+          threads->push_back(std::move(state->spare_threads.back()));
+          state->spare_threads.pop_back();
+        }
+      }
+      Thread &thread = (*threads)[count++];
+      thread.Reset(ts.thread_id, is_current);
+      ThreadCache *cache = &state->thread_caches[ts.thread_id];
+      if (cache->last_sample == state->sample) {
+        // Two thread states with the same id would share a cache, so their
+        // stacks can't be walked at the same time.
+        parallel = false;
+      }
+      cache->last_sample = state->sample;
+      state->walks.push_back({tstate, RemoteAddr(ts.frame), cache,
+                              WalkResult::Complete, {"", 0, 0}, {}, nullptr});
     }
 
     if (enable_threads) {
-      tstate = PtracePeek(pid, tstate + offsetof(PyThreadState, next));
+      tstate = RemoteAddr(ts.next);
     } else {
       tstate = 0;
     }
   };
+  while (threads->size() > count) {
+    state->spare_threads.push_back(std::move(threads->back()));
+    threads->pop_back();
+  }
 
-  return threads;
+  WalkThreads(state, detail, parallel, threads);
+  for (size_t i = 0; i < count; i++) {
+    const ThreadWalk &walk = state->walks[i];
+    if (state->stats != nullptr) {
+      state->stats->walk_time.Add(walk.time);
+      if (walk.result == WalkResult::Truncated) {
+        state->stats->partial++;
+      }
+    }
+    if (walk.result == WalkResult::Failed) {
+      CheckExited(*state, walk.error);
+      CountTruncated(state, walk.error, (*threads)[i].mutable_frames());
+    }
+  }
+
+  // Forget the stacks of threads that have exited, or that haven't been seen
+  // for a long time.
+  if (state->thread_caches.size() > count) {
+    for (auto it = state->thread_caches.begin();
+         it != state->thread_caches.end();) {
+      if (state->sample - it->second.last_sample > THREAD_CACHE_SAMPLES) {
+        it = state->thread_caches.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+}
+
+// Decode the frames that GetThreads() left pending. Each code object is read
+// again, and its string pointers are compared with the ones cached for its
+// address, so a code object that was freed and replaced at the same address is
+// decoded afresh; the strings and line table are still only read once for each
+// code object. If a frame can't be decoded, its thread's stack is cut short
+// there, and the thread's cache is dropped, since it has placeholders for the
+// frames that weren't decoded.
+void ResolveThreads(FrobState *state, FrameDetail detail,
+                    std::vector<Thread> *threads) {
+  if (state->walkers.empty()) {
+    return;
+  }
+  Walker *walker = &state->walkers[0];
+  for (const PendingFrame &pending : state->pending) {
+    Thread &thread = (*threads)[pending.thread];
+    std::vector<Frame> *frames = thread.mutable_frames();
+    if (pending.index >= frames->size()) {
+      // The stack was already cut short before this frame.
+      continue;
+    }
+    Frame *frame = &(*frames)[pending.index];
+    if (DecodeFrame(walker, pending.code, pending.lasti, pending.lineno,
+                    detail, frame)) {
+      state->thread_caches[thread.id()].Resolve(pending.index, *frame);
+      continue;
+    }
+    if (walker->error.err == ESRCH) {
+      state->pending.clear();
+      state->thread_caches.clear();
+      CheckExited(*state, walker->error);
+    }
+    state->thread_caches.erase(thread.id());
+    frames->erase(frames->begin() + pending.index, frames->end());
+    CountTruncated(state, walker->error, frames);
+  }
+  state->pending.clear();
 }
 }  // namespace py*
 }  // namespace pyflame
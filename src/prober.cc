@@ -15,13 +15,19 @@
 #include "./prober.h"
 
 #include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/ptrace.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <csignal>
 #include <cstring>
 #include <fstream>
 #include <iostream>
@@ -30,19 +36,26 @@
 #include <sstream>
 #include <string>
 #include <thread>
-#include <unordered_map>
 #include <utility>
 
+#include "./alloccount.h"
 #include "./config.h"
+#include "./errorlog.h"
 #include "./exc.h"
+#include "./exitwatcher.h"
 #include "./ptrace.h"
 #include "./pyfrob.h"
+#include "./ring.h"
+#include "./scheduler.h"
+#include "./stacktrie.h"
+#include "./stats.h"
 #include "./symbol.h"
 #include "./thread.h"
+#include "./window.h"
 
 // Microseconds in a second.
 static const char usage_str[] =
-    ("Usage: pyflame [options] [-p] PID\n"
+    ("Usage: pyflame [options] [-p] PID [-p PID...]\n"
      "       pyflame [options] -t command arg1 arg2...\n"
      "\n"
      "Common Options:\n"
@@ -55,7 +68,7 @@ static const char usage_str[] =
      "  -h, --help               Show help\n"
      "  -n, --no-line-numbers    Do not append line numbers to function names\n"
      "  -o, --output=PATH        Output to file path\n"
-     "  -p, --pid=PID            The PID to trace\n"
+     "  -p, --pid=PID            The PID to trace; may be repeated\n"
      "  -r, --rate=RATE          Sample rate, as a fractional value of seconds "
      "(default 0.01)\n"
      "  -s, --seconds=SECS       How many seconds to run for (default 1)\n"
@@ -65,8 +78,34 @@ static const char usage_str[] =
      "\n"
      "Advanced Options:\n"
      "  --abi                    Force a particular Python ABI (26, 34, 36)\n"
+     "  --bytecode-offsets       Report bytecode offsets instead of line "
+     "numbers\n"
+     "  --cpu=CPU                Pin pyflame to a CPU\n"
+     "  --defer-symbols          Decode frames after the process is continued\n"
      "  --flamechart             Include timestamps for generating Chrome "
-     "\"flamecharts\"\n");
+     "\"flamecharts\"\n"
+     "  --follow-forks           Also profile the processes that are forked "
+     "(implies\n"
+     "                           --per-pid)\n"
+     "  --jitter                 Randomize the intervals between samples\n"
+     "  --max-depth=DEPTH        Maximum number of frames to walk per stack "
+     "(default 1024)\n"
+     "  --nonstop                Read stacks without stopping the process\n"
+     "  --overhead-budget=PCT    Lower the sample rate as needed to stop the "
+     "process\n"
+     "                           for at most PCT percent of the time\n"
+     "  --per-pid                Profile each PID separately, under a root "
+     "frame\n"
+     "  --pids-from=PATH         Read PIDs to trace from PATH\n"
+     "  --output-dir=DIR         Write each --window to a new file in DIR\n"
+     "  --retain=N               Keep only the N most recent --window files\n"
+     "  --stats[=PATH]           Print sampling overhead statistics to stderr, "
+     "or PATH\n"
+     "  --window=DURATION        Write the profile to a new file every "
+     "DURATION (e.g.\n"
+     "                           60s), until the process exits\n"
+     "  --walkers=N              Walk up to N thread stacks at once (with "
+     "--threads)\n");
 
 // The ABIs supported in this Pyflame build.
 static const int build_abis[] = {
@@ -96,93 +135,188 @@ static inline std::chrono::microseconds ToMicroseconds(double val) {
   return std::chrono::microseconds{static_cast<long>(val * 1000000)};
 }
 
-static inline bool EndsWith(std::string const &value,
-                            std::string const &ending) {
-  if (ending.size() > value.size()) {
+// Parse a duration in seconds, with an optional unit suffix of s, m, or h.
+static bool ParseDuration(const char *str, double *secs) {
+  char *end;
+  *secs = std::strtod(str, &end);
+  if (end == str) {
     return false;
   }
-  return std::equal(ending.rbegin(), ending.rend(), value.rbegin());
+  switch (*end) {
+    case 'h':
+      *secs *= 60;
+    // fall through
+    case 'm':
+      *secs *= 60;
+    // fall through
+    case 's':
+      end++;
+      break;
+  }
+  return *end == '\0';
 }
 
-namespace pyflame {
+// Read the state and the parent PID of a process from /proc/PID/stat. Returns
+// false if the process doesn't exist.
+static bool ReadStat(pid_t pid, char *state, pid_t *ppid) {
+  std::ostringstream path;
+  path << "/proc/" << pid << "/stat";
+  std::ifstream stat(path.str());
+  std::string line;
+  if (!std::getline(stat, line)) {
+    return false;
+  }
+  // The state follows the command name, which is in parentheses and may itself
+  // contain spaces or parentheses.
+  const size_t paren = line.rfind(')');
+  if (paren == std::string::npos || paren + 2 >= line.size()) {
+    return false;
+  }
+  std::istringstream fields(line.substr(paren + 2));
+  return static_cast<bool>(fields >> *state >> *ppid);
+}
 
-typedef std::unordered_map<frames_t, size_t, FrameHash> buckets_t;
+// Check if a process that isn't being traced has exited. A zombie has exited
+// too, even though it's still in the process table.
+static bool ProcessExited(pid_t pid) {
+  char state;
+  pid_t ppid;
+  if (!ReadStat(pid, &state, &ppid)) {
+    return true;
+  }
+  return state == 'Z' || state == 'X';
+}
 
-// Prints all stack traces
-static void PrintFrames(std::ostream &out,
-                        const std::vector<FrameTS> &call_stacks,
-                        size_t idle_count, size_t failed_count, bool include_line_number) {
-  // Choose function to print frame
-  print_frame_t print_frame_ = include_line_number ? print_frame : print_frame_without_line_number;
+// The options to follow the processes forked by a target. Threads are not
+// followed: they're read through the interpreter state of their process.
+static const long kFollowOptions =
+    PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_TRACEEXEC;
 
-  if (idle_count) {
-    out << "(idle) " << idle_count << "\n";
+// Collect the exit status of a traced process that has exited, so that its
+// parent can reap it. This does nothing for processes that aren't traced.
+static inline void Reap(pid_t pid) { waitpid(pid, nullptr, WNOHANG | __WALL); }
+
+static inline double ToSeconds(std::chrono::microseconds val) {
+  return std::chrono::duration_cast<std::chrono::duration<double>>(val).count();
+}
+
+// Set by the signal handler: SIGINT and SIGTERM end profiling, and SIGUSR1
+// asks for a snapshot of the profile. These are atomics rather than
+// sig_atomic_t because the snapshot is taken by the aggregator thread.
+static std::atomic<bool> stop_requested(false);
+static std::atomic<bool> snapshot_requested(false);
+
+static void HandleSignal(int signum) {
+  if (signum == SIGUSR1) {
+    snapshot_requested = true;
+  } else {
+    stop_requested = true;
   }
-  if (failed_count) {
-    out << "(failed) " << failed_count << "\n";
+}
+
+// Handle the signals that end profiling early or ask for a snapshot. System
+// calls are restarted, so that waiting for a target isn't cut short; the
+// sampling loop checks for the signals between samples, and a stop ends the
+// wait for the next sample early. Without snapshots, SIGUSR1 is ignored: a
+// snapshot written to stdout would be followed by the final profile, and a
+// reader of the output would count each stack twice.
+static void InstallSignalHandlers(bool snapshots) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = HandleSignal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  for (int signum : {SIGINT, SIGTERM}) {
+    sigaction(signum, &sa, nullptr);
   }
-  // Put the call stacks into buckets
-  buckets_t buckets;
-  for (const auto &call_stack : call_stacks) {
-    auto bucket = buckets.find(call_stack.frames);
-    if (bucket == buckets.end()) {
-      buckets.insert(bucket, {call_stack.frames, 1});
-    } else {
-      bucket->second++;
-    }
+  if (!snapshots) {
+    sa.sa_handler = SIG_IGN;
   }
-  // Process the frames
-  for (const auto &kv : buckets) {
-    if (kv.first.empty()) {
-      std::cerr << "fatal error\n";
-      return;
-    }
-    auto last = kv.first.rend();
-    last--;
-    for (auto it = kv.first.rbegin(); it != last; ++it) {
-      print_frame_(out, *it);
-      out << ";";
-    }
-    print_frame_(out, *last);
-    out << " " << kv.second << "\n";
+  sigaction(SIGUSR1, &sa, nullptr);
+}
+
+// Block or unblock the signals handled above on the calling thread. Threads
+// started while they're blocked inherit the mask, so the signals are always
+// delivered to the sampling thread, and interrupt its sleep.
+static void BlockSignals(bool block) {
+  sigset_t set;
+  sigemptyset(&set);
+  for (int signum : {SIGINT, SIGTERM, SIGUSR1}) {
+    sigaddset(&set, signum);
   }
+  pthread_sigmask(block ? SIG_BLOCK : SIG_UNBLOCK, &set, nullptr);
 }
 
-// Prints all stack traces with timestamps
-static void PrintFramesTS(std::ostream &out,
-                          const std::vector<FrameTS> &call_stacks, bool include_line_number) {
-  // Choose function to print frame
-  print_frame_t print_frame_ = include_line_number ? print_frame : print_frame_without_line_number;
-
-  for (const auto &call_stack : call_stacks) {
-    out << std::chrono::duration_cast<std::chrono::microseconds>(
-               call_stack.ts.time_since_epoch())
-               .count()
-        << "\n";
-    // Handle idle
-    if (call_stack.frames.empty()) {
-      out << "(idle)\n";
-      continue;
-    }
-    if (call_stack.frames.size() == 1 &&
-        call_stack.frames.front().file() == "(failed)") {
-      out << "(failed)\n";
-      continue;
-    }
-    // Print the call stack
-    for (auto it = call_stack.frames.rbegin(); it != call_stack.frames.rend();
-         ++it) {
-      print_frame_(out, *it);
-      out << ";";
-    }
-    out << "\n";
+static inline bool EndsWith(std::string const &value,
+                            std::string const &ending) {
+  if (ending.size() > value.size()) {
+    return false;
   }
+  return std::equal(ending.rbegin(), ending.rend(), value.rbegin());
 }
 
+namespace pyflame {
+// A sample of one process, passed from the sampling loop to the aggregator
+// thread.
+struct Sample {
+  std::chrono::system_clock::time_point ts;
+  size_t target;  // Index of the process in targets_
+  pid_t pid;
+  uint64_t weight;
+  bool failed;  // The error is only logged, not kept with the sample
+
+  // The stacks of the threads are the first num_stacks entries of stacks. The
+  // rest are left over from earlier uses of the slot, and keep their memory.
+  size_t num_stacks;
+  std::vector<frames_t> stacks;
+};
+
+// The state shared by the sampling loop and the aggregator thread. The
+// sampling loop only pushes samples onto the ring and takes buffers off the
+// spare ring; everything else is owned by the aggregator thread until it's
+// joined.
+struct Pipeline {
+  Pipeline(size_t capacity, const OutputFormat &format, std::ostream *out)
+      : ring(capacity), spare(capacity), done(false), format(format),
+        out(out) {}
+
+  SpscRing<Sample> ring;
+
+  // Stack buffers that the aggregator thread has finished with, going back to
+  // the sampling loop. Every slot of the ring would otherwise have to grow its
+  // own buffers, so it would be thousands of ticks before sampling stopped
+  // allocating; this way only the few buffers in flight at once need to grow.
+  SpscRing<std::vector<frames_t>> spare;
+
+  // Set by the sampling loop after it has pushed its last sample.
+  std::atomic<bool> done;
+
+  Window window;
+  std::chrono::system_clock::time_point window_end;
+  std::unique_ptr<WindowWriter> writer;
+  const OutputFormat format;
+  std::ostream *out;
+
+  // With --window, hand the current window over to be written if t is past
+  // its end. Windows start on a fixed schedule, even if a boundary was missed.
+  void Advance(std::chrono::system_clock::time_point t,
+               std::chrono::microseconds length) {
+    if (!writer || t < window_end) {
+      return;
+    }
+    writer->Submit(&window);
+    do {
+      window.start = window_end;
+      window_end += length;
+    } while (t >= window_end);
+  }
+};
+
 int Prober::ParseOpts(int argc, char **argv) {
   static const char short_opts[] = "dhno:p:r:s:tvx";
   static struct option long_opts[] = {
     {"abi", required_argument, 0, 'a'},
+    {"bytecode-offsets", no_argument, 0, 'B'},
     {"dump", no_argument, 0, 'd'},
     {"help", no_argument, 0, 'h'},
     {"rate", required_argument, 0, 'r'},
@@ -195,12 +329,30 @@ int Prober::ParseOpts(int argc, char **argv) {
     {"pid", required_argument, 0, 'p'},
     {"trace", no_argument, 0, 't'},
     {"flamechart", no_argument, 0, 'T'},
+    {"follow-forks", no_argument, 0, 'K'},
+    {"cpu", required_argument, 0, 'C'},
+    {"defer-symbols", no_argument, 0, 'G'},
+    {"jitter", no_argument, 0, 'J'},
+    {"max-depth", required_argument, 0, 'D'},
+    {"nonstop", no_argument, 0, 'N'},
+    {"output-dir", required_argument, 0, 'U'},
+    {"overhead-budget", required_argument, 0, 'O'},
+    {"per-pid", no_argument, 0, 'P'},
+    {"pids-from", required_argument, 0, 'F'},
+    {"retain", required_argument, 0, 'E'},
+    {"stats", optional_argument, 0, 'S'},
     {"version", no_argument, 0, 'v'},
+    {"walkers", required_argument, 0, 'Q'},
+    {"window", required_argument, 0, 'W'},
     {"exclude-idle", no_argument, 0, 'x'},
     {0, 0, 0, 0}
   };
 
   long abi_version;
+  pid_t pid;
+  char *end;
+  double window;
+  bool seconds_given = false;
   for (;;) {
     int c = getopt_long(argc, argv, short_opts, long_opts, nullptr);
     if (c == -1) {
@@ -228,6 +380,34 @@ int Prober::ParseOpts(int argc, char **argv) {
             break;
         }
         break;
+      case 'B':
+        frame_detail_ = FrameDetail::ByteOffset;
+        break;
+      case 'C':
+        cpu_ = static_cast<int>(std::strtol(optarg, &end, 10));
+        if (*optarg == '\0' || *end != '\0' || cpu_ < 0 ||
+            cpu_ >= CPU_SETSIZE) {
+          std::cerr << "Invalid CPU: " << optarg << "\n";
+          return 1;
+        }
+        break;
+      case 'D':
+        max_depth_ = std::strtoul(optarg, nullptr, 10);
+        if (max_depth_ == 0) {
+          std::cerr << "Invalid maximum depth: " << optarg << "\n";
+          return 1;
+        }
+        break;
+      case 'E':
+        retain_ = std::strtoul(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0' || retain_ == 0) {
+          std::cerr << "Invalid retention count: " << optarg << "\n";
+          return 1;
+        }
+        break;
+      case 'G':
+        defer_symbols_ = true;
+        break;
       case 'd':
         dump_ = true;
 #if ENABLE_THREADS
@@ -243,16 +423,23 @@ int Prober::ParseOpts(int argc, char **argv) {
         enable_threads_ = true;
         break;
 #endif
+      case 'F':
+        if (ReadPids(optarg)) {
+          return 1;
+        }
+        break;
       case 'p':
-        if ((pid_ = ParsePid(optarg)) == -1) {
+        if ((pid = ParsePid(optarg)) == -1) {
           return 1;
         }
+        AddPid(pid);
         break;
       case 'r':
         sample_rate_ = std::stod(optarg);
         break;
       case 's':
         seconds_ = std::stod(optarg);
+        seconds_given = true;
         break;
       case 't':
         trace_ = true;
@@ -273,7 +460,52 @@ int Prober::ParseOpts(int argc, char **argv) {
         output_file_ = optarg;
         break;
       case 'n':
-        include_line_number_ = false;
+        frame_detail_ = FrameDetail::Function;
+        break;
+      case 'J':
+        jitter_ = true;
+        break;
+      case 'K':
+        follow_forks_ = true;
+        per_pid_ = true;
+        break;
+      case 'N':
+        nonstop_ = true;
+        break;
+      case 'P':
+        per_pid_ = true;
+        break;
+      case 'O':
+        overhead_budget_ = std::strtod(optarg, &end) / 100;
+        if (*optarg == '\0' || *end != '\0' || !(overhead_budget_ > 0) ||
+            overhead_budget_ > 1) {
+          std::cerr << "Invalid overhead budget: " << optarg << "\n";
+          return 1;
+        }
+        break;
+      case 'U':
+        output_dir_ = optarg;
+        break;
+      case 'Q':
+        walkers_ = std::strtoul(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0' || walkers_ == 0 ||
+            walkers_ > MAX_WALKERS) {
+          std::cerr << "Invalid number of walkers: " << optarg << "\n";
+          return 1;
+        }
+        break;
+      case 'W':
+        if (!ParseDuration(optarg, &window) || !(window > 0)) {
+          std::cerr << "Invalid window: " << optarg << "\n";
+          return 1;
+        }
+        window_ = ToMicroseconds(window);
+        break;
+      case 'S':
+        stats_ = true;
+        if (optarg != nullptr) {
+          stats_file_ = optarg;
+        }
         break;
       case '?':
         // getopt_long should already have printed an error message
@@ -284,11 +516,45 @@ int Prober::ParseOpts(int argc, char **argv) {
     }
   }
 finish_arg_parse:
+  if (window_ > std::chrono::microseconds::zero()) {
+    if (output_dir_.empty()) {
+      std::cerr << "Option --window requires --output-dir.\n";
+      return 1;
+    } else if (!output_file_.empty()) {
+      std::cerr << "Options --window and -o are not mutually compatible.\n";
+      return 1;
+    } else if (dump_) {
+      std::cerr << "Options --window and -d are not mutually compatible.\n";
+      return 1;
+    }
+    if (access(output_dir_.c_str(), W_OK | X_OK)) {
+      std::cerr << "cannot write to directory \"" << output_dir_
+                << "\": " << strerror(errno) << "\n";
+      return 1;
+    }
+    // Keep profiling until the processes exit, unless told otherwise.
+    if (!seconds_given) {
+      seconds_ = -1;
+    }
+  } else if (!output_dir_.empty() || retain_) {
+    std::cerr << "Options --output-dir and --retain require --window.\n";
+    return 1;
+  }
+  if (nonstop_ && follow_forks_) {
+    std::cerr << "Options --nonstop and --follow-forks are not mutually "
+                 "compatible.\n";
+    return 1;
+  }
+  if (nonstop_ && overhead_budget_ > 0) {
+    std::cerr << "Options --nonstop and --overhead-budget are not mutually "
+                 "compatible.\n";
+    return 1;
+  }
   if (trace_) {
     if (dump_) {
       std::cerr << "Options -t and -d are not mutually compatible.\n";
       return 1;
-    } else if (pid_ != -1) {
+    } else if (!pids_.empty()) {
       std::cerr << "Options -t and -p are not mutually compatible.\n";
       return 1;
     } else if (optind == argc) {
@@ -297,15 +563,16 @@ finish_arg_parse:
       return 1;
     }
     trace_target_ = argv[optind];
-  } else if (pid_ == -1) {
+  } else if (pids_.empty()) {
     // Users should use -p to supply the PID to trace. However, older versions
     // of Pyflame used a convention where the PID to trace was the final
     // argument to the pyflame command. This code path handles this legacy use
     // case, to preserve backward compatibility.
-    if (optind != argc - 1 || (pid_ = ParsePid(argv[optind])) == -1) {
+    if (optind != argc - 1 || (pid = ParsePid(argv[optind])) == -1) {
       std::cerr << usage_str;
       return 1;
     }
+    AddPid(pid);
     std::cerr << "WARNING: Specifying a PID to trace without -p is deprecated; "
                  "see Pyflame issue #99 for details.\n";
   }
@@ -321,11 +588,11 @@ int Prober::InitiatePtrace(char **argv) {
     }
     // In trace mode, all of the remaining arguments are a command to run. We
     // fork and have the child run the command; the parent traces.
-    pid_ = fork();
-    if (pid_ == -1) {
+    const pid_t pid = fork();
+    if (pid == -1) {
       perror("fork()");
       return 1;
-    } else if (pid_ == 0) {
+    } else if (pid == 0) {
       // Child: request to be traced.
       PtraceTraceme();
       if (execvp(trace_target_.c_str(), argv + optind)) {
@@ -340,9 +607,9 @@ int Prober::InitiatePtrace(char **argv) {
       // available. But there's no point in polling the child until it's at
       // least had a chance to run exec.
       pid_t child = waitpid(0, nullptr, 0);
-      assert(child == pid_);
-      PtraceSetOptions(pid_, PTRACE_O_TRACEEXEC);
-      PtraceCont(pid_);
+      assert(child == pid);
+      PtraceSetOptions(pid, PTRACE_O_TRACEEXEC);
+      PtraceCont(pid);
       int status = 0;
       while (!SawEventExec(status)) {
         pid_t p = waitpid(-1, &status, 0);
@@ -358,22 +625,29 @@ int Prober::InitiatePtrace(char **argv) {
       }
       // We can only use PtraceInterrupt, used later in the main loop, if the
       // process was seized. So we reattach and seize.
-      PtraceDetach(pid_);
-      PtraceSeize(pid_);
+      PtraceDetach(pid);
+      PtraceSeize(pid, follow_forks_ ? kFollowOptions : 0);
+      pids_.push_back(pid);
     }
-  } else {
-    try {
-      PtraceSeize(pid_);
-    } catch (const PtraceException &err) {
-      std::cerr << "Failed to seize PID " << pid_ << "\n";
-      return 1;
+  }
+  for (pid_t pid : pids_) {
+    if (!trace_) {
+      try {
+        PtraceSeize(pid, follow_forks_ ? kFollowOptions : 0);
+      } catch (const PtraceException &err) {
+        std::cerr << "Failed to seize PID " << pid << "\n";
+        return 1;
+      }
     }
+    // The frobber detaches from the process when it's destroyed, so create it
+    // as soon as the process is attached.
+    targets_.emplace_back(new Target(pid, enable_threads_, max_depth_));
+    PtraceInterrupt(pid);
   }
-  PtraceInterrupt(pid_);
   return 0;
 }
 
-int Prober::Run(const PyFrob &frobber) {
+int Prober::Run() {
   std::unique_ptr<std::ofstream> file_ptr;
   std::ostream *output;
   if (output_file_.empty()) {
@@ -388,106 +662,582 @@ int Prober::Run(const PyFrob &frobber) {
       return 1;
     }
   }
-  return dump_ ? DumpStacks(frobber, output) : ProbeLoop(frobber, output);
+  if (dump_) {
+    return DumpStacks(output);
+  }
+  // Snapshots either replace the output file, or are written as windows.
+  InstallSignalHandlers(!output_file_.empty() ||
+                        window_ > std::chrono::microseconds::zero());
+  return ProbeLoop(output);
 }
 
-// Main loop to probe the Python process.
-int Prober::ProbeLoop(const PyFrob &frobber, std::ostream *out) {
-  std::vector<FrameTS> call_stacks;
+void Prober::WriteProfile(std::ostream *out, const Window &window,
+                          const OutputFormat &format) {
+  if (!output_file_.empty()) {
+    // Replace what an earlier snapshot wrote.
+    out->flush();
+    if (truncate(output_file_.c_str(), 0)) {
+      std::cerr << "Failed to truncate \"" << output_file_
+                << "\": " << strerror(errno) << "\n";
+    }
+    out->seekp(0);
+  }
+  PrintWindow(*out, window, format);
+  out->flush();
+}
+
+// Main loop to probe the Python processes. All of the processes are sampled on
+// the same schedule; each one is only stopped while its own stacks are read.
+int Prober::ProbeLoop(std::ostream *out) {
   int return_code = 0;
-  size_t idle_count = 0;
-  size_t failed_count = 0;
+  Stats stats;
+  Scheduler scheduler(interval_, jitter_);
+  OverheadBudget budget(overhead_budget_);
+  ErrorLog errors(&std::cerr);
+
+  // Processes that exit are dropped, and the others are still sampled. If the
+  // kernel doesn't support pidfds, an exit is only noticed when a process can't
+  // be stopped or read any more.
+  BlockSignals(true);
+  if (walkers_ > 1 && enable_threads_) {
+    pool_.reset(new WorkerPool(walkers_));
+  }
+  for (const auto &target : targets_) {
+    watcher_.Add(target->pid);
+    target->frob->set_defer_symbols(defer_symbols_);
+    target->frob->set_pool(pool_.get());
+  }
+
+  const OutputFormat format = {
+      include_ts_, frame_detail_ != FrameDetail::Function, per_pid_};
+  Pipeline pipeline(SAMPLE_RING_SIZE, format, out);
+  if (window_ > std::chrono::microseconds::zero()) {
+    pipeline.writer.reset(new WindowWriter(output_dir_, retain_, format));
+  }
+
+  // The number of base intervals that the current sample stands for. This is
+  // always 1 unless there is an overhead budget.
+  uint64_t weight = 1;
   bool check_end = seconds_ >= 0;
   auto end = std::chrono::system_clock::now() + ToMicroseconds(seconds_);
+  if (nonstop_) {
+    // Rather than continuing the processes and leaving them attached, detach
+    // entirely, so that signals sent to the processes don't stop them either.
+    for (const auto &target : targets_) {
+      target->frob->Detach();
+    }
+  }
+  // The processes are already stopped when the loop starts.
+  for (const auto &target : targets_) {
+    target->stopped = std::chrono::steady_clock::now();
+  }
+  stats.Start();
+  scheduler.Start();
+  pipeline.window.start = std::chrono::system_clock::now();
+  pipeline.window_end = pipeline.window.start + window_;
+  std::thread aggregator(&Prober::Aggregate, this, &pipeline);
+  BlockSignals(false);
+  std::vector<pid_t> exited;
+  // Only the sampling thread is pinned. The aggregator, the window writer, and
+  // the walkers are started first, so that they keep the original affinity and
+  // run on the other CPUs.
+  if (cpu_ != -1 && !PinToCPU(cpu_)) {
+    std::cerr << "Failed to pin to CPU " << cpu_ << ": " << strerror(errno)
+              << "\n";
+    return_code = 1;
+    goto finish;
+  }
   for (;;) {
+    if (stop_requested) {
+      break;
+    }
+    // Once every buffer has grown to fit the largest stacks, a tick shouldn't
+    // allocate at all.
+    const uint64_t allocations = Allocations();
     auto now = std::chrono::system_clock::now();
-    try {
-      std::vector<Thread> threads = frobber.GetThreads();
-
-      // Only true for non-GIL stacks that we couldn't find a way to profile
-      // Currently this means stripped builds on non-AMD64 archs
-      if (threads.empty() && include_idle_) {
-        idle_count++;
-        // Timestamp empty call stacks only if required. Since lots of time the
-        // process will be idle, this is a good optimization to have.
-        if (include_ts_) {
-          call_stacks.push_back({now, {}});
+    const bool last = check_end && (now + interval_ >= end);
+    if (follow_forks_) {
+      HandleEvents();
+    }
+    watcher_.Poll(&exited);
+    for (pid_t pid : exited) {
+      for (const auto &target : targets_) {
+        if (target->pid == pid && target->live) {
+          Reap(pid);
+          target->live = false;
+        }
+      }
+    }
+    size_t num_live = 0;
+    for (const auto &target : targets_) {
+      num_live += target->live;
+    }
+    if (num_live == 0) {
+      break;
+    }
+
+    // The longest time that any of the processes was stopped for.
+    std::chrono::nanoseconds max_stop_time{0};
+    for (size_t i = 0; i < targets_.size(); i++) {
+      Target &target = *targets_[i];
+      const pid_t pid = target.pid;
+      if (!target.live) {
+        continue;
+      } else if (!target.resolved && target.retries >= MAX_TRACE_RETRIES) {
+        // This isn't a Python process, and it's only followed for the
+        // processes it forks.
+        if (!target.running && !last) {
+          try {
+            PtraceCont(pid);
+            target.running = true;
+          } catch (const PtraceException &exc) {
+          }
         }
+        continue;
+      }
+      Sample *sample = pipeline.ring.Back();
+      if (sample == nullptr) {
+        // The aggregator thread has fallen behind. Rather than stopping the
+        // process for a sample that there's no room for, skip it.
+        stats.dropped++;
+        continue;
       }
+      sample->ts = now;
+      sample->target = i;
+      sample->pid = pid;
+      sample->weight = weight;
+      sample->failed = false;
+      bool counted = false;
+      try {
+        if (target.running) {
+          if (SawEventExec(Interrupt(&target))) {
+            target.frob->Reset();
+            target.resolved = false;
+            target.retries = 0;
+          }
+          target.stopped = std::chrono::steady_clock::now();
+        }
+        if (!target.resolved && !Resolve(&target)) {
+          if (!last) {
+            PtraceCont(pid);
+            target.running = true;
+          }
+          continue;
+        }
+        counted = true;
+        stats.samples++;
+        stats.weighted += weight;
+        target.frob->set_stats(stats_ ? &stats : nullptr);
+        const uint64_t truncated = target.frob->truncated();
+        const std::vector<Thread> &threads =
+            target.frob->GetThreads(frame_detail_);
+
+        // Only true for non-GIL stacks that we couldn't find a way to profile
+        // Currently this means stripped builds on non-AMD64 archs
+        stats.threads += threads.size();
+        if (threads.empty()) {
+          stats.idle++;
+        }
+
+        if (!nonstop_ && !last) {
+          const auto stop_time =
+              std::chrono::steady_clock::now() - target.stopped;
+          stats.stop_time.Add(stop_time);
+          max_stop_time = std::max(
+              max_stop_time,
+              std::chrono::duration_cast<std::chrono::nanoseconds>(stop_time));
+          PtraceCont(pid);
+          target.running = true;
+        }
+        if (defer_symbols_) {
+          target.frob->ResolveThreads(frame_detail_);
+        }
+        if (target.frob->truncated() != truncated) {
+          // The frames that were read are still in the sample.
+          if (std::ostream *log = errors.Report()) {
+            *log << "Truncated a stack of PID " << pid << ": "
+                 << target.frob->walk_error() << "\n";
+          }
+        }
 
-      for (const auto &thread : threads) {
-        call_stacks.push_back({now, thread.frames()});
+        // The stacks are copied for the aggregator thread once the process is
+        // running again.
+        if (!threads.empty() || include_idle_) {
+          std::vector<frames_t> *spare = pipeline.spare.Front();
+          if (spare != nullptr) {
+            sample->stacks.swap(*spare);
+            pipeline.spare.Pop();
+          }
+          sample->num_stacks = threads.size();
+          if (sample->stacks.size() < threads.size()) {
+            sample->stacks.resize(threads.size());
+          }
+          for (size_t j = 0; j < threads.size(); j++) {
+            const frames_t &frames = threads[j].frames();
+            sample->stacks[j].assign(frames.begin(), frames.end());
+          }
+          pipeline.ring.Push();
+        }
+      } catch (const TerminateException &exc) {
+        // If a process terminates early then we just print the stack traces up
+        // until that point in time.
+        if (counted) {
+          stats.samples--;
+          stats.weighted -= weight;
+        }
+        target.live = false;
+      } catch (const PtraceException &exc) {
+        // Without ptrace, the only sign that the process has exited is that it
+        // can't be read any more.
+        if (ProcessExited(pid)) {
+          if (counted) {
+            stats.samples--;
+            stats.weighted -= weight;
+          }
+          Reap(pid);
+          target.live = false;
+          continue;
+        }
+        if (!counted) {
+          stats.samples++;
+          stats.weighted += weight;
+        }
+        stats.failed++;
+        sample->failed = true;
+        pipeline.ring.Push();
+        if (std::ostream *log = errors.Report()) {
+          *log << "Unexpected ptrace(2) exception: " << exc.what() << "\n";
+        }
+        if (!nonstop_ && !last && !target.running) {
+          // Leave the process running until the next sample.
+          try {
+            PtraceCont(pid);
+            target.running = true;
+          } catch (const PtraceException &exc) {
+          }
+        }
+      } catch (const std::exception &exc) {
+        std::cerr << "Unexpected generic exception: " << exc.what() << "\n";
+        return_code = 1;
+        goto finish;
       }
+    }
+    if (Allocations() != allocations) {
+      stats.allocations += Allocations() - allocations;
+      stats.allocating_ticks++;
+      stats.last_allocating = stats.samples;
+    }
+    if (last) {
+      break;
+    }
+    if (overhead_budget_ > 0) {
+      weight = budget.Update(max_stop_time, interval_);
+      scheduler.set_interval(interval_ * weight);
+    }
+    scheduler.Wait(stop_requested);
+  }
+finish:
+  errors.Flush();
+  pipeline.done.store(true, std::memory_order_release);
+  aggregator.join();
 
-      if (check_end && (now + interval_ >= end)) {
-        break;
+  // Stop the processes that are still running, so that they can be detached.
+  // Interrupting a process can add more targets, so this can't use iterators.
+  for (size_t i = 0; i < targets_.size(); i++) {
+    Target *target = targets_[i].get();
+    if (target->live && target->running) {
+      try {
+        Interrupt(target);
+      } catch (const std::exception &exc) {
+      }
+    }
+  }
+  if (stats_) {
+    stats.Stop();
+    stats.missed = scheduler.missed();
+    stats.targets = targets_.size();
+    for (const auto &target : targets_) {
+      stats.reads += target->frob->reads();
+      stats.bytes += target->frob->bytes();
+      target->frob->set_stats(nullptr);
+    }
+    PrintStats(stats);
+  }
+  if (pipeline.writer) {
+    // The last window is cut short.
+    pipeline.writer->Submit(&pipeline.window);
+    pipeline.writer->Finish();
+  } else {
+    WriteProfile(out, pipeline.window, format);
+  }
+  return return_code;
+}
+
+void Prober::Aggregate(Pipeline *pipeline) {
+  // The longest that a sample waits in the ring before it's aggregated.
+  const auto delay = std::min(interval_, std::chrono::microseconds(10000));
+  for (;;) {
+    // Everything pushed before done was set is consumed below.
+    const bool done = pipeline->done.load(std::memory_order_acquire);
+    for (Sample *sample = pipeline->ring.Front(); sample != nullptr;
+         sample = pipeline->ring.Front()) {
+      pipeline->Advance(sample->ts, window_);
+      AddSample(&pipeline->window, *sample);
+      std::vector<frames_t> *spare = pipeline->spare.Back();
+      if (spare != nullptr) {
+        spare->swap(sample->stacks);
+        pipeline->spare.Push();
       }
-      PtraceCont(pid_);
-      std::this_thread::sleep_for(interval_);
-      PtraceInterrupt(pid_);
-    } catch (const TerminateException &exc) {
-      // If the process terminates early then we just print the stack traces up
-      // until that point in time.
-      goto finish;
-    } catch (const PtraceException &exc) {
-      failed_count++;
-      if (include_ts_) {
-        // include the exact failures in the call stacks
-        call_stacks.push_back({now, {{"(failed)", exc.what(), 0}}});
+      pipeline->ring.Pop();
+    }
+    const auto now = std::chrono::system_clock::now();
+    if (snapshot_requested.exchange(false)) {
+      if (pipeline->writer) {
+        // Cut the current window short; the next one ends on schedule.
+        pipeline->writer->Submit(&pipeline->window);
+        pipeline->window.start = now;
+      } else {
+        WriteProfile(pipeline->out, pipeline->window, pipeline->format);
       }
-      std::cerr << "Unexpected ptrace(2) exception: " << exc.what() << "\n";
-    } catch (const std::exception &exc) {
-      std::cerr << "Unexpected generic exception: " << exc.what() << "\n";
-      return_code = 1;
-      goto finish;
     }
+    pipeline->Advance(now, window_);
+    if (done) {
+      return;
+    }
+    std::this_thread::sleep_for(delay);
   }
-finish:
-  if (!call_stacks.empty() || idle_count || failed_count) {
-    if (!include_ts_) {
-      PrintFrames(*out, call_stacks, idle_count, failed_count, include_line_number_);
+}
+
+void Prober::AddSample(Window *window, const Sample &sample) {
+  // Processes forked since the last sample get a profile of their own. A new
+  // window starts out without any profiles.
+  const size_t index = per_pid_ ? sample.target : 0;
+  while (window->profiles.size() <= index) {
+    window->profiles.emplace_back();
+    window->pids.push_back(0);
+  }
+  window->pids[index] = sample.pid;
+  Profile &profile = window->profiles[index];
+  if (sample.failed) {
+    profile.failed_count += sample.weight;
+    if (include_ts_) {
+      // include the failures in the call stacks
+      window->call_stacks.push_back({sample.ts, {}, sample.pid, true});
+    }
+    return;
+  }
+  if (sample.num_stacks == 0) {
+    profile.idle_count += sample.weight;
+    // Timestamp empty call stacks only if required. Since lots of time the
+    // process will be idle, this is a good optimization to have.
+    if (include_ts_) {
+      window->call_stacks.push_back({sample.ts, {}, sample.pid, false});
+    }
+  }
+  for (size_t i = 0; i < sample.num_stacks; i++) {
+    if (include_ts_) {
+      window->call_stacks.push_back(
+          {sample.ts, sample.stacks[i], sample.pid, false});
     } else {
-      PrintFramesTS(*out, call_stacks, include_line_number_);
+      profile.stacks.Add(sample.stacks[i], sample.weight);
     }
   }
-  return return_code;
 }
 
-int Prober::DumpStacks(const PyFrob &frobber, std::ostream *out) {
-  std::vector<Thread> threads = frobber.GetThreads();
-  for (size_t i = 0; i < threads.size(); i++) {
-    *out << threads[i];
-    if (i < threads.size() - 1) {
-      *out << "\n";
+void Prober::HandleEvents() {
+  for (;;) {
+    int status;
+    const pid_t pid = waitpid(-1, &status, WNOHANG | __WALL);
+    if (pid <= 0) {
+      break;
+    }
+    HandleEvent(pid, status);
+  }
+}
+
+void Prober::HandleEvent(pid_t pid, int status) {
+  Target *target = nullptr;
+  for (const auto &t : targets_) {
+    if (t->pid == pid && t->live) {
+      target = t.get();
+    }
+  }
+  if (target == nullptr) {
+    // A process that was forked from a target reports a stop when it's
+    // attached.
+    if (WIFSTOPPED(status)) {
+      Adopt(pid);
+    }
+    return;
+  }
+  if (!WIFSTOPPED(status)) {
+    target->live = false;
+    return;
+  }
+  int signum = 0;
+  if (SawEventExec(status)) {
+    target->frob->Reset();
+    target->resolved = false;
+    target->retries = 0;
+  } else if (status >> 16 == 0) {
+    // A signal is being delivered to the process; pass it on.
+    signum = WSTOPSIG(status);
+  }
+  // Otherwise this is a fork, which is handled when the child stops, or the
+  // stop for an interrupt that arrived after another event.
+  try {
+    PtraceCont(pid, signum);
+    target->running = true;
+  } catch (const PtraceException &exc) {
+  }
+}
+
+int Prober::Interrupt(Target *target) {
+  target->running = false;
+  PtraceInterrupt(target->pid, false);
+  for (;;) {
+    int status;
+    const pid_t pid =
+        waitpid(follow_forks_ ? -1 : target->pid, &status, __WALL);
+    if (pid == -1) {
+      std::ostringstream ss;
+      ss << "Failed to waitpid(): " << strerror(errno);
+      throw PtraceException(ss.str());
+    } else if (pid != target->pid) {
+      HandleEvent(pid, status);
+      continue;
+    }
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+      std::ostringstream ss;
+      ss << "Child process " << pid << " exited";
+      throw TerminateException(ss.str());
+    }
+    // A signal being delivered is passed on; the interrupt is still pending.
+    // Any other stop is a ptrace event, or the interrupt itself.
+    if (WIFSTOPPED(status) && WSTOPSIG(status) != SIGTRAP &&
+        status >> 16 == 0) {
+      PtraceCont(pid, WSTOPSIG(status));
+      continue;
+    }
+    return status;
+  }
+}
+
+void Prober::Adopt(pid_t pid) {
+  std::unique_ptr<Target> target(
+      new Target(pid, enable_threads_, max_depth_));
+  target->frob->set_defer_symbols(defer_symbols_);
+  target->frob->set_pool(pool_.get());
+  char state;
+  pid_t ppid;
+  if (ReadStat(pid, &state, &ppid)) {
+    for (const auto &parent : targets_) {
+      if (parent->pid == ppid && parent->live && parent->resolved) {
+        target->frob->Inherit(*parent->frob);
+        target->resolved = true;
+        break;
+      }
+    }
+  }
+  // The process is sampled from the next tick on. Until then it has to run, so
+  // that e.g. a parent waiting in vfork(2) can be stopped too.
+  try {
+    PtraceCont(pid);
+    target->running = true;
+  } catch (const PtraceException &exc) {
+    return;
+  }
+  watcher_.Add(pid);
+  targets_.push_back(std::move(target));
+}
+
+bool Prober::Resolve(Target *target) {
+  // A process that was just forked or exec'ed may still be loading libpython,
+  // so keep trying for a while, as with -t. After that the process isn't
+  // sampled, but the processes that it forks are still followed.
+  try {
+    if (target->frob->DetectABI(abi_) == 0) {
+      target->resolved = true;
+      return true;
+    }
+    target->retries++;
+  } catch (const FatalException &exc) {
+    target->retries = MAX_TRACE_RETRIES;
+  }
+  return false;
+}
+
+void Prober::PrintStats(const Stats &stats) {
+  if (stats_file_.empty()) {
+    stats.Print(std::cerr, ToSeconds(interval_), nonstop_);
+    return;
+  }
+  std::ofstream file(stats_file_, std::ios::out | std::ios::trunc);
+  if (!file.is_open()) {
+    std::cerr << "cannot open file \"" << stats_file_ << "\" for statistics\n";
+    return;
+  }
+  stats.Print(file, ToSeconds(interval_), nonstop_);
+}
+
+int Prober::DumpStacks(std::ostream *out) {
+  for (size_t t = 0; t < targets_.size(); t++) {
+    if (targets_.size() > 1) {
+      *out << (t ? "\n" : "") << "PID " << targets_[t]->pid << ":\n";
+    }
+    const std::vector<Thread> &threads =
+        targets_[t]->frob->GetThreads(frame_detail_);
+    for (size_t i = 0; i < threads.size(); i++) {
+      *out << threads[i];
+      if (i < threads.size() - 1) {
+        *out << "\n";
+      }
     }
   }
   return 0;
 }
 
-int Prober::FindSymbols(PyFrob *frobber) {
+int Prober::FindSymbols() {
   // When tracing a dynamically linked Python build, it may take a while for
   // ld.so to actually load symbols into the process. Therefore we retry probing
   // in a loop, until the symbols are loaded. A more reliable way of doing this
   // would be to break at entry to a known static function (e.g. Py_Main), but
   // this isn't reliable in all cases. For instance, /usr/bin/python{,3} will
   // start at Py_Main, but uWSGI will not.
-  try {
-    for (size_t i = 0;;) {
-      if (frobber->DetectABI(abi_)) {
-        if (++i >= MaxRetries()) {
-          std::cerr << "Failed to locate libpython within timeout period.\n";
-          return 1;
+  for (const auto &target : targets_) {
+    const pid_t pid = target->pid;
+    try {
+      for (size_t i = 0;;) {
+        if (target->frob->DetectABI(abi_)) {
+          if (follow_forks_) {
+            // Keep trying in the main loop, where the events of other
+            // processes are handled while this one is waited for.
+            target->retries = 1;
+            break;
+          }
+          if (++i >= MaxRetries()) {
+            std::cerr << "Failed to locate libpython within timeout period";
+            if (targets_.size() > 1) {
+              std::cerr << " for PID " << pid;
+            }
+            std::cerr << ".\n";
+            return 1;
+          }
+          PtraceCont(pid);
+          std::this_thread::sleep_for(interval_);
+          PtraceInterrupt(pid);
+          continue;
         }
-        PtraceCont(pid_);
-        std::this_thread::sleep_for(interval_);
-        PtraceInterrupt(pid_);
-        continue;
+        target->resolved = true;
+        break;
       }
-      break;
+    } catch (const FatalException &exc) {
+      if (!follow_forks_) {
+        std::cerr << exc.what() << "\n";
+        return 1;
+      }
+      target->retries = MAX_TRACE_RETRIES;
     }
-  } catch (const FatalException &exc) {
-    std::cerr << exc.what() << "\n";
-    return 1;
   }
   return 0;
 }
@@ -500,4 +1250,34 @@ pid_t Prober::ParsePid(const char *pid_str) {
   }
   return static_cast<pid_t>(pid);
 }
+
+void Prober::AddPid(pid_t pid) {
+  if (std::find(pids_.begin(), pids_.end(), pid) == pids_.end()) {
+    pids_.push_back(pid);
+  }
+}
+
+int Prober::ReadPids(const char *path) {
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    std::cerr << "cannot open file \"" << path << "\" to read PIDs\n";
+    return 1;
+  }
+  // The PIDs are separated by whitespace, e.g. the output of pgrep(1).
+  size_t count = 0;
+  std::string token;
+  while (file >> token) {
+    const pid_t pid = ParsePid(token.c_str());
+    if (pid == -1) {
+      return 1;
+    }
+    AddPid(pid);
+    count++;
+  }
+  if (count == 0) {
+    std::cerr << "No PIDs in file \"" << path << "\"\n";
+    return 1;
+  }
+  return 0;
+}
 }  // namespace pyflame
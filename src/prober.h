@@ -15,10 +15,18 @@
 #pragma once
 
 #include <chrono>
+#include <memory>
 #include <string>
+#include <vector>
 
+#include "./alloccount.h"
+#include "./frame.h"
 #include "./pyfrob.h"
+#include "./stats.h"
+#include "./exitwatcher.h"
 #include "./symbol.h"
+#include "./window.h"
+#include "./workerpool.h"
 
 // Maximum number of times to retry checking for Python symbols when -p is used.
 #define MAX_ATTACH_RETRIES 1
@@ -26,54 +34,174 @@
 // Maximum number of times to retry checking for Python symbols when -t is used.
 #define MAX_TRACE_RETRIES 50
 
+// Default maximum number of frames to walk for each stack.
+#define DEFAULT_MAX_DEPTH 1024
+
+// Number of samples that can be waiting for the aggregator thread. If it falls
+// this far behind, samples are dropped.
+#define SAMPLE_RING_SIZE 4096
+
+// Maximum number of threads that --walkers can ask for.
+#define MAX_WALKERS 64
+
 namespace pyflame {
 
+struct Pipeline;
+struct Sample;
+
+// A process being profiled.
+struct Target {
+  Target(pid_t pid, bool enable_threads, size_t max_depth)
+      : pid(pid),
+        frob(new PyFrob(pid, enable_threads, max_depth)),
+        live(true),
+        running(false),
+        resolved(false),
+        retries(0) {}
+  Target(const Target &other) = delete;
+
+  pid_t pid;
+  std::unique_ptr<PyFrob> frob;  // Detaches from the process when destroyed
+
+  bool live;      // False once the process has exited or been dropped
+  bool running;   // True if the process was continued after its last sample
+  bool resolved;  // True once the Python symbols have been found
+  size_t retries;  // Failed attempts to find the symbols
+
+  // When the process was last stopped, for measuring how long it stays
+  // stopped.
+  std::chrono::steady_clock::time_point stopped;
+};
+
 class Prober {
  public:
   Prober()
       : abi_(PyABI::Unknown),
-        pid_(-1),
         dump_(false),
         trace_(false),
         include_idle_(true),
         include_ts_(false),
-        include_line_number_(true),
+        frame_detail_(FrameDetail::Line),
         enable_threads_(false),
+        max_depth_(DEFAULT_MAX_DEPTH),
+        nonstop_(false),
+        defer_symbols_(false),
+        walkers_(1),
+        jitter_(false),
+        cpu_(-1),
+        overhead_budget_(0),
+        per_pid_(false),
+        follow_forks_(false),
+        stats_(false),
+        retain_(0),
+        window_(0),
         seconds_(1),
         sample_rate_(0.01) {}
   Prober(const Prober &other) = delete;
 
   int ParseOpts(int argc, char **argv);
 
+  // Attach to and stop each of the target processes.
   int InitiatePtrace(char **argv);
 
-  int FindSymbols(PyFrob *frobber);
-
-  int Run(const PyFrob &frobber);
+  int FindSymbols();
 
-  inline bool enable_threads() const { return enable_threads_; }
-  inline pid_t pid() const { return pid_; }
+  int Run();
 
  private:
   PyABI abi_;
-  pid_t pid_;
   bool dump_;
   bool trace_;
   bool include_idle_;
   bool include_ts_;
-  bool include_line_number_;
+  FrameDetail frame_detail_;
   bool enable_threads_;
+  size_t max_depth_;
+  bool nonstop_;
+  bool defer_symbols_;
+  size_t walkers_;
+  bool jitter_;
+  int cpu_;
+  double overhead_budget_;  // Fraction of time, or 0 for no budget
+  bool per_pid_;
+  bool follow_forks_;
+  bool stats_;
+  size_t retain_;                     // Files to keep, or 0 to keep them all
+  std::chrono::microseconds window_;  // Length of each window, or 0
   double seconds_;
   double sample_rate_;
   std::chrono::microseconds interval_;
   std::string output_file_;
+  std::string output_dir_;
+  std::string stats_file_;
   std::string trace_target_;
 
+  // With --walkers, the threads that the targets' stacks are walked on.
+  std::unique_ptr<WorkerPool> pool_;
+
+  // The PIDs given on the command line, and the processes being profiled.
+  // With --follow-forks, processes are added to targets_ as they're forked.
+  std::vector<pid_t> pids_;
+  std::vector<std::unique_ptr<Target>> targets_;
+
+  // Detects the targets exiting.
+  ExitWatcher watcher_;
+
   pid_t ParsePid(const char *pid_str);
 
-  int ProbeLoop(const PyFrob &frobber, std::ostream *out);
+  // Add a target process, unless it was already added.
+  void AddPid(pid_t pid);
+
+  // Add the target processes listed in a file.
+  int ReadPids(const char *path);
+
+  // Sample the processes until the end of the run. The stacks are aggregated
+  // and written out on a separate thread, so that the sampling loop only stops
+  // the processes, reads their stacks, and copies them.
+  int ProbeLoop(std::ostream *out);
 
-  int DumpStacks(const PyFrob &frobber, std::ostream *out);
+  // The aggregator thread: add the samples that ProbeLoop() takes to the
+  // current window, and write out snapshots and windows.
+  void Aggregate(Pipeline *pipeline);
+
+  // Add a sample to the profile of its process in window.
+  void AddSample(Window *window, const Sample &sample);
+
+  // Write the samples collected so far to out. If the output is a file, what
+  // was written before is replaced, so the file always holds one profile.
+  void WriteProfile(std::ostream *out, const Window &window,
+                    const OutputFormat &format);
+
+  // Handle the ptrace events that the targets stopped for since the last
+  // sample: new children to adopt, exec(2)s, signals, and exits.
+  void HandleEvents();
+
+  // Handle a wait status that isn't the one being waited for.
+  void HandleEvent(pid_t pid, int status);
+
+  // Stop a running target, and return the wait status of the stop. Signals
+  // that arrive for the target in the meantime are passed on to it. With
+  // --follow-forks, other events are handled while waiting, since a process
+  // may not stop until a child it forked has run (e.g. after vfork(2)).
+  int Interrupt(Target *target);
+
+  // Start profiling a process that was forked from one of the targets, and
+  // was attached automatically. The process is stopped.
+  void Adopt(pid_t pid);
+
+  // Look for the Python symbols of a stopped target that doesn't have them
+  // yet. Returns true if it can be sampled.
+  bool Resolve(Target *target);
+
+  int DumpStacks(std::ostream *out);
+
+  void PrintStats(const Stats &stats);
+
+  // The number of heap allocations made so far by the sampling thread, and by
+  // the walkers working for it.
+  inline uint64_t Allocations() const {
+    return ThreadAllocations() + (pool_ ? pool_->allocations() : 0);
+  }
 
   inline size_t MaxRetries() const {
     return trace_ ? MAX_TRACE_RETRIES : MAX_ATTACH_RETRIES;
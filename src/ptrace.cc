@@ -22,6 +22,7 @@
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -49,7 +50,7 @@ int DoWait(pid_t pid, int options) {
       if (signum == SIGTRAP) {
         break;
       } else if (signum == SIGCHLD) {
-        PtraceCont(pid);  // see issue #122
+        PtraceCont(pid, SIGCHLD);  // see issue #122
         continue;
       }
       ss << "waitpid() indicated a WIFSTOPPED process, but got unexpected "
@@ -60,6 +61,10 @@ int DoWait(pid_t pid, int options) {
       ss << "Child process " << pid << " exited with status "
          << WEXITSTATUS(status);
       throw TerminateException(ss.str());
+    } else if (WIFSIGNALED(status)) {
+      ss << "Child process " << pid << " was killed by signal "
+         << WTERMSIG(status);
+      throw TerminateException(ss.str());
     } else {
       ss << "Child process " << pid
          << " returned an unexpected waitpid() code: " << status;
@@ -94,8 +99,8 @@ void PtraceAttach(pid_t pid) {
   }
 }
 
-void PtraceSeize(pid_t pid) {
-  if (ptrace(PTRACE_SEIZE, pid, 0, 0)) {
+void PtraceSeize(pid_t pid, long options) {
+  if (ptrace(PTRACE_SEIZE, pid, 0, options)) {
     std::ostringstream ss;
     ss << "Failed to attach to PID " << pid << ": " << strerror(errno);
     throw PtraceException(ss.str());
@@ -115,11 +120,11 @@ static inline void SafeDetach(pid_t pid) noexcept {
   ptrace(PTRACE_DETACH, pid, 0, 0);
 }
 
-void PtraceInterrupt(pid_t pid) {
+int PtraceInterrupt(pid_t pid, bool wait) {
   if (ptrace(PTRACE_INTERRUPT, pid, 0, 0)) {
     throw PtraceException("Failed to PTRACE_INTERRUPT");
   }
-  DoWait(pid);
+  return wait ? DoWait(pid) : 0;
 }
 
 user_regs_struct PtraceGetRegs(pid_t pid) {
@@ -150,25 +155,31 @@ void PtracePoke(pid_t pid, unsigned long addr, long data) {
 }
 
 long PtracePeek(pid_t pid, unsigned long addr) {
-  errno = 0;
-  const long data = ptrace(PTRACE_PEEKDATA, pid, addr, 0);
-  if (data == -1 && errno != 0) {
+  long data;
+  const int err = PtraceTryPeek(pid, addr, &data);
+  if (err) {
     std::ostringstream ss;
     ss << "Failed to PTRACE_PEEKDATA (pid " << pid << ", addr "
-       << reinterpret_cast<void *>(addr) << "): " << strerror(errno);
+       << reinterpret_cast<void *>(addr) << "): " << strerror(err);
     throw PtraceException(ss.str());
   }
   return data;
 }
 
+int PtraceTryPeek(pid_t pid, unsigned long addr, long *data) {
+  errno = 0;
+  *data = ptrace(PTRACE_PEEKDATA, pid, addr, 0);
+  return *data == -1 ? errno : 0;
+}
+
 void PtraceSetOptions(pid_t pid, long options) {
   if (ptrace(PTRACE_SETOPTIONS, pid, 0, options)) {
     throw PtraceException("Failed to PTRACE_SETOPTIONS");
   }
 }
 
-void PtraceCont(pid_t pid) {
-  if (ptrace(PTRACE_CONT, pid, 0, 0) == -1) {
+void PtraceCont(pid_t pid, int signum) {
+  if (ptrace(PTRACE_CONT, pid, 0, signum) == -1) {
     std::ostringstream ss;
     ss << "Failed to PTRACE_CONT: " << strerror(errno);
     throw PtraceException(ss.str());
@@ -184,45 +195,11 @@ void PtraceSingleStep(pid_t pid) {
   DoWait(pid);
 }
 
-std::string PtracePeekString(pid_t pid, unsigned long addr) {
-  std::ostringstream dump;
-  unsigned long off = 0;
-  while (true) {
-    const long val = PtracePeek(pid, addr + off);
-
-    // XXX: this can be micro-optimized, c.f.
-    // https://graphics.stanford.edu/~seander/bithacks.html#ZeroInWord
-    const std::string chunk(reinterpret_cast<const char *>(&val), sizeof(val));
-    dump << chunk.c_str();
-    if (chunk.find_first_of('\0') != std::string::npos) {
-      break;
-    }
-    off += sizeof(val);
-  }
-  return dump.str();
-}
-
-std::unique_ptr<uint8_t[]> PtracePeekBytes(pid_t pid, unsigned long addr,
-                                           size_t nbytes) {
-  // align the buffer to a word size
-  if (nbytes % sizeof(long)) {
-    nbytes = (nbytes / sizeof(long) + 1) * sizeof(long);
-  }
-  std::unique_ptr<uint8_t[]> bytes(new uint8_t[nbytes]);
-
-  size_t off = 0;
-  while (off < nbytes) {
-    const long val = PtracePeek(pid, addr + off);
-    memmove(bytes.get() + off, &val, sizeof(val));
-    off += sizeof(val);
-  }
-  return bytes;
-}
-
 #if defined(__amd64__) && ENABLE_THREADS
 static const long syscall_x86 = 0x050f;  // x86 code for SYSCALL
 
-static unsigned long probe_ = 0;
+// The trampoline page allocated by AllocPage() in each process, by PID.
+static std::unordered_map<pid_t, unsigned long> probes_;
 
 static unsigned long AllocPage(pid_t pid) {
   user_regs_struct oldregs = PtraceGetRegs(pid);
@@ -278,11 +255,13 @@ static void ResumeChildThreads(pid_t pid) {
 }
 
 long PtraceCallFunction(pid_t pid, unsigned long addr) {
-  if (probe_ == 0) {
+  unsigned long &page = probes_[pid];
+  if (page == 0) {
     PauseChildThreads(pid);
-    probe_ = AllocPage(pid);
+    page = AllocPage(pid);
     ResumeChildThreads(pid);
-    if (probe_ == (unsigned long)MAP_FAILED) {
+    if (page == (unsigned long)MAP_FAILED) {
+      probes_.erase(pid);
       return -1;
     }
 
@@ -291,13 +270,13 @@ long PtraceCallFunction(pid_t pid, unsigned long addr) {
     new_code_bytes[0] = 0xff;  // CALL
     new_code_bytes[1] = 0xd0;  // rax
     new_code_bytes[2] = 0xcc;  // TRAP
-    PtracePoke(pid, probe_, code);
+    PtracePoke(pid, page, code);
   }
 
   user_regs_struct oldregs = PtraceGetRegs(pid);
   user_regs_struct newregs = oldregs;
   newregs.rax = addr;
-  newregs.rip = probe_;
+  newregs.rip = page;
 
   PtraceSetRegs(pid, newregs);
   PtraceCont(pid);
@@ -308,16 +287,21 @@ long PtraceCallFunction(pid_t pid, unsigned long addr) {
   return newregs.rax;
 };
 
+void PtraceForgetPage(pid_t pid) { probes_.erase(pid); }
+
 void PtraceCleanup(pid_t pid) noexcept {
   // Clean up the memory area allocated by AllocPage().
-  if (probe_ != 0) {
+  auto probe = probes_.find(pid);
+  if (probe != probes_.end()) {
+    const unsigned long page = probe->second;
+    probes_.erase(probe);
     try {
       const user_regs_struct oldregs = PtraceGetRegs(pid);
       const long orig_code = PtracePeek(pid, oldregs.rip);
 
       user_regs_struct newregs = oldregs;
       newregs.rax = SYS_munmap;
-      newregs.rdi = probe_;         // addr
+      newregs.rdi = page;           // addr
       newregs.rsi = getpagesize();  // len
 
       // Prepare to run munmap(2) syscall.
@@ -331,7 +315,6 @@ void PtraceCleanup(pid_t pid) noexcept {
       const long rax = PtraceGetRegs(pid).rax;
       switch (rax) {
         case 0:
-          probe_ = 0;
           break;
         case EAGAIN:
           goto do_munmap;
@@ -356,6 +339,8 @@ void PtraceCleanup(pid_t pid) noexcept {
   SafeDetach(pid);
 }
 #else
+void PtraceForgetPage(pid_t pid) {}
+
 void PtraceCleanup(pid_t pid) noexcept { SafeDetach(pid); }
 #endif
 
@@ -18,7 +18,6 @@
 #include <sys/user.h>
 #include <unistd.h>
 
-#include <memory>
 #include <string>
 
 #include "./config.h"
@@ -29,6 +28,10 @@ typedef struct user_regs user_regs_struct;
 typedef struct user_regs_struct user_regs_struct;
 #endif
 
+// Strings in the target longer than this are assumed to be garbage; this is
+// longer than any path.
+#define MAX_STRING_LENGTH 4096
+
 namespace pyflame {
 
 int DoWait(pid_t pid, int options = 0);
@@ -41,8 +44,13 @@ void PtraceTraceme();
 void PtraceAttach(pid_t pid);
 void PtraceDetach(pid_t pid);
 
-void PtraceSeize(pid_t pid);
-void PtraceInterrupt(pid_t pid);
+// Seize a process, setting the given PTRACE_O_* options.
+void PtraceSeize(pid_t pid, long options = 0);
+
+// Stop a seized process. Returns the wait status of the stop, which may be a
+// ptrace event stop (e.g. PTRACE_EVENT_EXEC) that was reported first. If wait
+// is false, the caller has to wait for the stop, and 0 is returned.
+int PtraceInterrupt(pid_t pid, bool wait = true);
 
 // get regs from a process
 user_regs_struct PtraceGetRegs(pid_t pid);
@@ -56,17 +64,14 @@ void PtracePoke(pid_t pid, unsigned long addr, long data);
 // read the long word at an address
 long PtracePeek(pid_t pid, unsigned long addr);
 
-void PtraceSetOptions(pid_t pid, long options);
-
-// peek a null-terminated string
-std::string PtracePeekString(pid_t pid, unsigned long addr);
+// read the long word at an address into data; returns 0, or the errno value if
+// the word couldn't be read, rather than throwing
+int PtraceTryPeek(pid_t pid, unsigned long addr, long *data);
 
-// peek some number of bytes
-std::unique_ptr<uint8_t[]> PtracePeekBytes(pid_t pid, unsigned long addr,
-                                           size_t nbytes);
+void PtraceSetOptions(pid_t pid, long options);
 
-// Continue a traced process
-void PtraceCont(pid_t pid);
+// Continue a traced process, delivering signum to it if it's nonzero
+void PtraceCont(pid_t pid, int signum = 0);
 
 // Execute a single instruction in a traced process
 void PtraceSingleStep(pid_t pid);
@@ -76,6 +81,10 @@ void PtraceSingleStep(pid_t pid);
 long PtraceCallFunction(pid_t pid, unsigned long addr);
 #endif
 
+// Forget the page allocated in PtraceCallFunction(), after the process exec'ed
+// a new program and so unmapped it.
+void PtraceForgetPage(pid_t pid);
+
 // Detach, and maybe dealloc the page allocated in PtraceCallFunction();
 void PtraceCleanup(pid_t pid) noexcept;
 }  // namespace pyflame
@@ -28,11 +28,10 @@ int main(int argc, char **argv) {
   if (prober.InitiatePtrace(argv)) {
     return 1;
   }
-  PyFrob frobber(prober.pid(), prober.enable_threads());
-  if (prober.FindSymbols(&frobber)) {
+  if (prober.FindSymbols()) {
     return 1;
   }
 
   // Probe in a loop.
-  return prober.Run(frobber);
+  return prober.Run();
 }
@@ -14,7 +14,9 @@
 
 #include "./pyfrob.h"
 
+#include <cstring>
 #include <fstream>
+#include <map>
 #include <sstream>
 
 #include "./aslr.h"
@@ -25,12 +27,38 @@
 #include "./ptrace.h"
 #include "./symbol.h"
 
-#define FROB_FUNCS                                            \
-  std::vector<Thread> GetThreads(pid_t pid, PyAddresses addr, \
-                                 bool enable_threads);
+#define FROB_FUNCS                                                         \
+  void GetThreads(FrobState *state, PyAddresses addr, bool enable_threads,   \
+                  FrameDetail detail, std::vector<Thread> *threads);         \
+  void ResolveThreads(FrobState *state, FrameDetail detail,                  \
+                      std::vector<Thread> *threads);
 
 namespace pyflame {
 namespace {
+// The addresses found in an ELF file, before relocation.
+struct SymbolCacheEntry {
+  PyAddresses addrs;
+  PyABI abi;
+};
+
+// Get the addresses in an ELF file that has been parsed. Walking the symbol
+// table of a large file is the expensive part of attaching, so the result is
+// shared by all of the processes that map the same file.
+PyAddresses CachedAddresses(ELF *elf, PyABI *abi) {
+  static std::map<ELFId, SymbolCacheEntry> cache;
+  auto it = cache.find(elf->id());
+  if (it == cache.end()) {
+    SymbolCacheEntry entry;
+    entry.abi = PyABI::Unknown;
+    entry.addrs = elf->GetAddresses(&entry.abi);
+    it = cache.insert({elf->id(), entry}).first;
+  }
+  if (abi != nullptr) {
+    *abi = it->second.abi;
+  }
+  return it->second.addrs;
+}
+
 // locate within libpython
 PyAddresses AddressesFromLibPython(pid_t pid, const std::string &libpython,
                                    Namespace *ns, PyABI *abi) {
@@ -45,7 +73,7 @@ PyAddresses AddressesFromLibPython(pid_t pid, const std::string &libpython,
   ELF pyelf;
   pyelf.Open(elf_path, ns);
   pyelf.Parse();
-  const PyAddresses addrs = pyelf.GetAddresses(abi);
+  const PyAddresses addrs = CachedAddresses(&pyelf, abi);
   if (addrs.empty()) {
     throw SymbolException("Failed to locate addresses");
   }
@@ -78,7 +106,7 @@ PyAddresses Addrs(pid_t pid, Namespace *ns, PyABI *abi) {
   // the full soname. That determines where we need to look to find our symbol
   // table.
 
-  PyAddresses addrs = target.GetAddresses(abi);
+  PyAddresses addrs = CachedAddresses(&target, abi);
   if (addrs) {
     if (addrs.pie) {
       // If Python executable is PIE, add offsets
@@ -161,16 +189,19 @@ int PyFrob::DetectABI(PyABI abi) {
 #ifdef ENABLE_PY26
     case PyABI::Py26:
       get_threads_ = py26::GetThreads;
+      resolve_threads_ = py26::ResolveThreads;
       break;
 #endif
 #ifdef ENABLE_PY34
     case PyABI::Py34:
       get_threads_ = py34::GetThreads;
+      resolve_threads_ = py34::ResolveThreads;
       break;
 #endif
 #ifdef ENABLE_PY36
     case PyABI::Py36:
       get_threads_ = py36::GetThreads;
+      resolve_threads_ = py36::ResolveThreads;
       break;
 #endif
     default:
@@ -186,6 +217,17 @@ int PyFrob::DetectABI(PyABI abi) {
   return 0;
 }
 
+std::ostream &operator<<(std::ostream &os, const WalkError &error) {
+  os << error.reason;
+  if (error.addr != 0) {
+    os << " at " << reinterpret_cast<void *>(error.addr);
+  }
+  if (error.err != 0) {
+    os << ": " << strerror(error.err);
+  }
+  return os;
+}
+
 std::string PyFrob::Status() const {
   std::ostringstream os;
   os << "/proc/" << pid_ << "/stat";
@@ -195,7 +237,55 @@ std::string PyFrob::Status() const {
   return line;
 }
 
-std::vector<Thread> PyFrob::GetThreads(void) const {
-  return get_threads_(pid_, addrs_, enable_threads_);
+uint64_t PyFrob::reads() const {
+  uint64_t reads = state_.mem.reads();
+  for (const auto &reader : state_.readers) {
+    reads += reader.reads();
+  }
+  return reads;
+}
+
+uint64_t PyFrob::bytes() const {
+  uint64_t bytes = state_.mem.bytes();
+  for (const auto &reader : state_.readers) {
+    bytes += reader.bytes();
+  }
+  return bytes;
+}
+
+const std::vector<Thread> &PyFrob::GetThreads(FrameDetail detail) {
+  get_threads_(&state_, addrs_, enable_threads_, detail, &threads_);
+  return threads_;
+}
+
+void PyFrob::ResolveThreads(FrameDetail detail) {
+  // The process may be running, so anything read as a code object is checked.
+  state_.code_type = addrs_.code_type_addr;
+  resolve_threads_(&state_, detail, &threads_);
+}
+
+void PyFrob::Inherit(const PyFrob &parent) {
+  addrs_ = parent.addrs_;
+  get_threads_ = parent.get_threads_;
+  resolve_threads_ = parent.resolve_threads_;
+}
+
+void PyFrob::Reset() {
+  addrs_ = PyAddresses();
+  PtraceForgetPage(pid_);
+  state_.mem.Reset();
+  state_.code_cache.Clear();
+  state_.thread_caches.clear();
+  state_.pending.clear();
+  state_.walkers.clear();
+  state_.readers.clear();
+}
+
+void PyFrob::Detach() {
+  PtraceCleanup(pid_);
+  attached_ = false;
+  state_.nonstop = true;
+  state_.frame_type = addrs_.frame_type_addr;
+  state_.code_type = addrs_.code_type_addr;
 }
 }  // namespace pyflame
@@ -14,39 +14,265 @@
 
 #pragma once
 
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+
+#include "./codecache.h"
 #include "./ptrace.h"
+#include "./remote.h"
+#include "./stats.h"
 #include "./symbol.h"
 #include "./thread.h"
+#include "./threadcache.h"
+#include "./workerpool.h"
+
+// Maximum number of threads to walk. A longer thread list is assumed to be
+// garbage, e.g. from reading it while threads are created and destroyed.
+#define MAX_THREADS 65536
+
+// Maximum number of times to retry walking a stack that changed while it was
+// being read, in non-stop mode.
+#define MAX_NONSTOP_RETRIES 3
+
+// Number of samples that a thread can go unseen before its ThreadCache is
+// dropped. Without --threads only the thread holding the GIL is walked, so a
+// thread that is still running can be missing from many samples in a row.
+#define THREAD_CACHE_SAMPLES 1000
+
+// Minimum number of stacks in a sample for them to be walked in parallel, when
+// there is a worker pool. Waking the workers costs about as much as walking a
+// few stacks.
+#define MIN_PARALLEL_WALKS 8
 
 // This abstracts the representation of py2/py3
 namespace pyflame {
 
+// A frame that was read with deferred symbol resolution, and still has to be
+// decoded. Only the fields of the frame object that are needed to decode it
+// are kept.
+struct PendingFrame {
+  size_t thread;       // Index of the thread
+  size_t index;        // Index of the frame in the thread's stack
+  unsigned long code;  // f_code
+  int lasti;           // f_lasti
+  int lineno;          // f_lineno if the frame is being traced, or -1
+};
+
+// Why the walk of a stack stopped short of the outermost frame. The fields are
+// only formatted into a message if the error is logged, so recording an error
+// is cheap.
+struct WalkError {
+  const char *reason;  // e.g. "not a frame"
+  unsigned long addr;  // Remote address of the object involved, or 0
+  int err;             // errno value from the read, or 0
+};
+
+std::ostream &operator<<(std::ostream &os, const WalkError &error);
+
+// How the walk of a stack ended.
+enum class WalkResult {
+  Complete,   // Reached the outermost frame
+  Truncated,  // Cut short by max_depth, or by a loop in the f_back chain
+  Failed,     // A frame couldn't be read
+};
+
+// A stack to walk in the current sample, and how the walk went.
+struct ThreadWalk {
+  unsigned long tstate;  // Remote address of the PyThreadState
+  unsigned long frame;   // The thread's current frame
+  ThreadCache *cache;
+  WalkResult result;
+  WalkError error;                // Why the walk failed
+  std::chrono::nanoseconds time;  // How long the walk took, with stats
+  std::exception_ptr exception;   // What the walk threw, if anything
+};
+
+struct FrobState;
+
+// The state of one of the threads walking stacks. Stacks can be walked by
+// several threads at once, so everything that a walk writes to is kept here,
+// except for the thread caches, of which each walk has its own, and the code
+// cache, which is shared under a lock.
+struct Walker {
+  Walker(FrobState *state, RemoteMemory *mem)
+      : state(state), mem(mem), error{"", 0, 0} {}
+
+  FrobState *state;
+  RemoteMemory *mem;
+  std::vector<PendingFrame> pending;
+  WalkError error;
+};
+
+// State that the ABI specific code keeps for a process between samples.
+struct FrobState {
+  FrobState(pid_t pid, size_t max_depth)
+      : mem(pid),
+        max_depth(max_depth),
+        nonstop(false),
+        defer(false),
+        frame_type(0),
+        code_type(0),
+        stats(nullptr),
+        pool(nullptr),
+        sample(0),
+        truncated(0),
+        error{"", 0, 0} {}
+  FrobState(const FrobState &other) = delete;
+
+  RemoteMemory mem;
+  CodeCache code_cache;
+
+  // Held while code_cache, or a CodeInfo in it, is used.
+  std::mutex code_mutex;
+
+  // Maximum number of frames to walk for each thread.
+  size_t max_depth;
+
+  // True if the process keeps running while it's read, so the reads have to be
+  // checked for consistency.
+  bool nonstop;
+
+  // True if only the code object address and the position within it are read
+  // for each frame while the process is stopped. The frames are left in
+  // pending, with placeholders in the stacks, until ResolveThreads() is called.
+  bool defer;
+  std::vector<PendingFrame> pending;
+
+  // Remote addresses of PyFrame_Type and PyCode_Type. If these are set, the
+  // objects read as frames and code objects are checked to have these types.
+  unsigned long frame_type;
+  unsigned long code_type;
+
+  // If set, the time to walk each thread, and the number of truncated stacks,
+  // are recorded here.
+  Stats *stats;
+
+  // If set, the stacks of a sample are walked in parallel by this pool.
+  WorkerPool *pool;
+
+  // The walkers, one for each worker of the pool that has walked a stack of
+  // this process. The first one reads with mem, and is the only one that is
+  // used without a pool; the others each have their own reader, from readers.
+  std::deque<Walker> walkers;
+  std::deque<RemoteMemory> readers;
+
+  // The stacks of the current sample, in the order of the threads.
+  std::vector<ThreadWalk> walks;
+
+  // The stack of each thread in the previous sample, keyed by thread id.
+  std::unordered_map<unsigned long, ThreadCache> thread_caches;
+
+  // Thread objects left over from samples that had more threads than the
+  // current one, which keep their frame vectors for the next sample that needs
+  // them.
+  std::vector<Thread> spare_threads;
+
+  // Number of calls to GetThreads() so far.
+  uint64_t sample;
+
+  // Number of stacks so far that were cut short because a frame or code object
+  // couldn't be read, and the error that cut short the most recent one.
+  uint64_t truncated;
+  WalkError error;
+};
+
 // Get the threads. Each thread stack will be in reverse order (most recent
-// frame first).
-typedef std::vector<Thread> (*get_threads_t)(pid_t, PyAddresses, bool);
+// frame first). The threads vector is reused between calls.
+typedef void (*get_threads_t)(FrobState *, PyAddresses, bool, FrameDetail,
+                              std::vector<Thread> *);
+
+// Decode the frames that GetThreads() left pending.
+typedef void (*resolve_threads_t)(FrobState *, FrameDetail,
+                                  std::vector<Thread> *);
 
 // Frobber to get python stack stuff; this encapsulates all of the Python
 // interpreter logic.
 class PyFrob {
  public:
-  PyFrob(pid_t pid, bool enable_threads)
-      : pid_(pid), enable_threads_(enable_threads) {}
-  ~PyFrob() { PtraceCleanup(pid_); }
+  PyFrob(pid_t pid, bool enable_threads, size_t max_depth)
+      : pid_(pid),
+        state_(pid, max_depth),
+        enable_threads_(enable_threads),
+        attached_(true) {}
+  ~PyFrob() {
+    if (attached_) {
+      PtraceCleanup(pid_);
+    }
+  }
 
   // Must be called before GetThreads() to detect the Python ABI.
   int DetectABI(PyABI abi);
 
-  // Get the current frame list.
-  std::vector<Thread> GetThreads(void) const;
+  // Get the current frame list, with the given level of detail. The returned
+  // reference is only valid until the next call.
+  //
+  // If a frame can't be read, e.g. because it was freed while the stack was
+  // walked, the stack ends with the frames that were read and a
+  // TruncatedFrame(), and truncated() goes up. This only throws if the thread
+  // list can't be read, or the process has exited.
+  //
+  // With deferred symbols, the frames that had to be read are placeholders
+  // until ResolveThreads() is called; frames that are unchanged since the
+  // previous sample are complete.
+  const std::vector<Thread> &GetThreads(FrameDetail detail);
+
+  // Decode the frames left pending by GetThreads(), in the threads it returned.
+  // The process doesn't need to be stopped: the code objects that are read are
+  // checked to still be code objects, and are matched against what's cached
+  // for their address, so a reused address is noticed.
+  void ResolveThreads(FrameDetail detail);
+
+  // Only read the frame objects while the process is stopped, and leave the
+  // code objects to be decoded by ResolveThreads().
+  inline void set_defer_symbols(bool defer) { state_.defer = defer; }
+
+  // Detach from the process and leave it running. Subsequent calls to
+  // GetThreads() read the stacks while the process runs, and check the reads
+  // for consistency. The process must be stopped.
+  void Detach();
+
+  // Use the symbols found in parent, which the process was forked from, instead
+  // of calling DetectABI(). The memory layout of a forked process is the same.
+  void Inherit(const PyFrob &parent);
+
+  // Forget everything known about the process, after it exec'ed a new program.
+  // DetectABI() has to be called again before GetThreads().
+  void Reset();
+
+  // Record measurements of the stack walks in stats.
+  inline void set_stats(Stats *stats) { state_.stats = stats; }
+
+  // Walk the stacks of each sample in parallel with pool, if there are enough
+  // of them. The pool can be shared with other processes, since they're
+  // sampled one at a time.
+  inline void set_pool(WorkerPool *pool) { state_.pool = pool; }
+
+  // The number of remote memory reads made, and bytes requested, so far.
+  uint64_t reads() const;
+  uint64_t bytes() const;
+
+  // The number of stacks that were cut short so far, and why the most recent
+  // one was.
+  inline uint64_t truncated() const { return state_.truncated; }
+  inline const WalkError &walk_error() const { return state_.error; }
 
   // Useful when debugging.
   std::string Status() const;
 
  private:
   pid_t pid_;
+  FrobState state_;
   PyAddresses addrs_;
   bool enable_threads_;
+  bool attached_;
   get_threads_t get_threads_;
+  resolve_threads_t resolve_threads_;
+  std::vector<Thread> threads_;
 
   // Fill the addrs_ member
   int set_addrs_(PyABI *abi);
@@ -0,0 +1,148 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "./remote.h"
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+
+#include "./exc.h"
+#include "./ptrace.h"
+
+namespace pyflame {
+namespace {
+void ThrowReadError(const char *what, pid_t pid, unsigned long addr,
+                    size_t nbytes, int err) {
+  std::ostringstream ss;
+  ss << "Failed to " << what << " (pid " << pid << ", addr "
+     << reinterpret_cast<void *>(addr) << ", " << nbytes
+     << " bytes): " << strerror(err);
+  throw PtraceException(ss.str());
+}
+}  // namespace
+
+RemoteMemory::~RemoteMemory() {
+  if (mem_fd_ != -1) {
+    close(mem_fd_);
+  }
+}
+
+void RemoteMemory::Reset() {
+  if (mem_fd_ != -1) {
+    close(mem_fd_);
+    mem_fd_ = -1;
+  }
+  backend_ = Backend::VmReadv;
+}
+
+const char *RemoteMemory::BackendName(Backend backend) {
+  switch (backend) {
+    case Backend::VmReadv:
+      return "process_vm_readv";
+    case Backend::ProcMem:
+      return "read /proc/PID/mem";
+    case Backend::Peek:
+      return "PTRACE_PEEKDATA";
+  }
+  return "read";
+}
+
+void RemoteMemory::Read(unsigned long addr, void *buf, size_t nbytes) {
+  const int err = TryRead(addr, buf, nbytes);
+  if (err) {
+    ThrowReadError(BackendName(backend_), pid_, addr, nbytes, err);
+  }
+}
+
+int RemoteMemory::TryRead(unsigned long addr, void *buf, size_t nbytes) {
+  reads_++;
+  bytes_ += nbytes;
+  int err = 0;
+  switch (backend_) {
+    case Backend::VmReadv:
+      if (ReadVm(addr, buf, nbytes, &err)) {
+        return err;
+      }
+      backend_ = Backend::ProcMem;
+      // fall through
+    case Backend::ProcMem:
+      if (ReadProcMem(addr, buf, nbytes, &err)) {
+        return err;
+      }
+      backend_ = Backend::Peek;
+      // fall through
+    case Backend::Peek:
+      err = ReadPeek(addr, buf, nbytes);
+      break;
+  }
+  return err;
+}
+
+bool RemoteMemory::ReadVm(unsigned long addr, void *buf, size_t nbytes,
+                          int *err) {
+  struct iovec local = {buf, nbytes};
+  struct iovec remote = {reinterpret_cast<void *>(addr), nbytes};
+  const ssize_t n = process_vm_readv(pid_, &local, 1, &remote, 1, 0);
+  if (n == static_cast<ssize_t>(nbytes)) {
+    *err = 0;
+    return true;
+  }
+  if (n == -1 && (errno == ENOSYS || errno == EPERM)) {
+    // The kernel doesn't have process_vm_readv(2), or a security policy
+    // forbids it; try another backend.
+    return false;
+  }
+  // A short read means part of the range isn't mapped.
+  *err = n == -1 ? errno : EFAULT;
+  return true;
+}
+
+bool RemoteMemory::ReadProcMem(unsigned long addr, void *buf, size_t nbytes,
+                               int *err) {
+  if (mem_fd_ == -1) {
+    std::ostringstream path;
+    path << "/proc/" << pid_ << "/mem";
+    mem_fd_ = open(path.str().c_str(), O_RDONLY | O_CLOEXEC);
+    if (mem_fd_ == -1) {
+      return false;
+    }
+  }
+  const ssize_t n = pread(mem_fd_, buf, nbytes, static_cast<off_t>(addr));
+  *err = n == static_cast<ssize_t>(nbytes) ? 0 : n == -1 ? errno : EFAULT;
+  return true;
+}
+
+int RemoteMemory::ReadPeek(unsigned long addr, void *buf, size_t nbytes) {
+  uint8_t *out = reinterpret_cast<uint8_t *>(buf);
+  size_t off = 0;
+  while (off < nbytes) {
+    long val;
+    const int err = PtraceTryPeek(pid_, addr + off, &val);
+    if (err) {
+      return err;
+    }
+    const size_t len = std::min(sizeof(val), nbytes - off);
+    memmove(out + off, &val, len);
+    off += len;
+  }
+  return 0;
+}
+}  // namespace pyflame
@@ -0,0 +1,97 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace pyflame {
+
+// Reader for the memory of a remote process. Reading word-at-a-time with
+// PTRACE_PEEKDATA costs one syscall per eight bytes, so this tries to read
+// entire regions at once: first with process_vm_readv(2), then with pread(2) on
+// /proc/PID/mem, and finally by falling back to PTRACE_PEEKDATA. The first
+// backend that works is remembered for subsequent reads.
+class RemoteMemory {
+ public:
+  RemoteMemory() = delete;
+  RemoteMemory(const RemoteMemory &other) = delete;
+  explicit RemoteMemory(pid_t pid)
+      : pid_(pid),
+        mem_fd_(-1),
+        backend_(Backend::VmReadv),
+        reads_(0),
+        bytes_(0) {}
+  ~RemoteMemory();
+
+  // Read nbytes at remote address addr into buf. Throws PtraceException if the
+  // memory cannot be read.
+  void Read(unsigned long addr, void *buf, size_t nbytes);
+
+  // Like Read(), but returns 0 on success, or the errno value if the memory
+  // cannot be read. This is for the stack walk, where a frame that was freed
+  // while it was being read is an expected failure, and is cheap to recover
+  // from.
+  int TryRead(unsigned long addr, void *buf, size_t nbytes);
+
+  // Read the long word at remote address addr.
+  long ReadWord(unsigned long addr) {
+    long word;
+    Read(addr, &word, sizeof(word));
+    return word;
+  }
+
+  // Read a value of type T at remote address addr.
+  template <typename T>
+  void ReadValue(unsigned long addr, T *value) {
+    Read(addr, value, sizeof(T));
+  }
+
+  // Start over with the first backend, e.g. after the process exec'ed a new
+  // program.
+  void Reset();
+
+  inline pid_t pid() const { return pid_; }
+
+  // Whether reads may be made from threads other than the tracer. This is true
+  // unless reads have fallen back to PTRACE_PEEKDATA.
+  inline bool concurrent() const { return backend_ != Backend::Peek; }
+
+  // The number of reads made, and bytes requested, so far.
+  inline uint64_t reads() const { return reads_; }
+  inline uint64_t bytes() const { return bytes_; }
+
+ private:
+  enum class Backend { VmReadv, ProcMem, Peek };
+
+  pid_t pid_;
+  int mem_fd_;
+  Backend backend_;
+  uint64_t reads_;
+  uint64_t bytes_;
+
+  // The name of a backend, for error messages.
+  static const char *BackendName(Backend backend);
+
+  // Each of these returns false if the backend isn't usable at all, in which
+  // case the caller should move on to the next backend. Otherwise *err is set
+  // to 0, or to the errno value if the address couldn't be read.
+  bool ReadVm(unsigned long addr, void *buf, size_t nbytes, int *err);
+  bool ReadProcMem(unsigned long addr, void *buf, size_t nbytes, int *err);
+  int ReadPeek(unsigned long addr, void *buf, size_t nbytes);
+};
+}  // namespace pyflame
@@ -0,0 +1,88 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace pyflame {
+
+// A bounded, lock free queue between one producer thread and one consumer
+// thread.
+//
+// The slots are allocated up front and reused: the producer fills in the slot
+// returned by Back() in place, and the consumer reads the slot returned by
+// Front() in place, so objects that own memory (e.g. vectors) keep their
+// capacity from one use of a slot to the next, and a steady stream of items
+// doesn't allocate.
+template <typename T>
+class SpscRing {
+ public:
+  // The capacity is rounded up to a power of two.
+  explicit SpscRing(size_t capacity) : head_(0), tail_(0) {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    slots_.resize(size);
+    mask_ = size - 1;
+  }
+  SpscRing(const SpscRing &other) = delete;
+
+  // Producer: get the slot to fill in next, or nullptr if the ring is full.
+  // The slot isn't visible to the consumer until Push() is called.
+  T *Back() {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) > mask_) {
+      return nullptr;
+    }
+    return &slots_[tail & mask_];
+  }
+
+  // Producer: hand the slot returned by Back() over to the consumer.
+  void Push() {
+    tail_.store(tail_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+  }
+
+  // Consumer: get the oldest slot that was pushed, or nullptr if the ring is
+  // empty.
+  T *Front() {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+    return &slots_[head & mask_];
+  }
+
+  // Consumer: give the slot returned by Front() back to the producer.
+  void Pop() {
+    head_.store(head_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+  }
+
+  inline size_t capacity() const { return slots_.size(); }
+
+ private:
+  std::vector<T> slots_;
+  size_t mask_;
+
+  // The producer and consumer each write one of the indices; keep them on
+  // separate cache lines so that they don't contend.
+  alignas(64) std::atomic<size_t> head_;  // Next slot to read
+  alignas(64) std::atomic<size_t> tail_;  // Next slot to write
+};
+}  // namespace pyflame
@@ -0,0 +1,104 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "./scheduler.h"
+
+#include <sched.h>
+#include <time.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+
+namespace pyflame {
+namespace {
+const int64_t kNanosPerSecond = 1000000000;
+
+int64_t Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * kNanosPerSecond + ts.tv_nsec;
+}
+}  // namespace
+
+Scheduler::Scheduler(std::chrono::microseconds interval, bool jitter)
+    : interval_(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(interval)
+              .count()),
+      jitter_(jitter),
+      deadline_(0),
+      missed_(0),
+      rng_(std::random_device()()),
+      exponential_(1.0) {}
+
+void Scheduler::Start() { deadline_ = Now(); }
+
+int64_t Scheduler::Next() {
+  if (!jitter_) {
+    return interval_;
+  }
+  return static_cast<int64_t>(exponential_(rng_) * interval_);
+}
+
+void Scheduler::Wait(const std::atomic<bool> &stop) {
+  deadline_ += Next();
+  const int64_t now = Now();
+  while (now - deadline_ >= interval_) {
+    deadline_ += Next();
+    missed_++;
+  }
+
+  // The sleep is cut short by any signal, but only a signal that stops
+  // profiling ends it; with an overhead budget, the deadline can be a long way
+  // off.
+  struct timespec ts;
+  ts.tv_sec = deadline_ / kNanosPerSecond;
+  ts.tv_nsec = deadline_ % kNanosPerSecond;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) ==
+             EINTR &&
+         !stop) {
+  }
+}
+
+void Scheduler::set_interval(std::chrono::nanoseconds interval) {
+  interval_ = interval.count();
+}
+
+uint64_t OverheadBudget::Update(std::chrono::nanoseconds stop,
+                                std::chrono::microseconds base_interval) {
+  // An exponentially weighted moving average, so that one slow sample doesn't
+  // throw the rate off, but a lasting change in stack depth is followed within
+  // a few tens of samples.
+  const double alpha = 0.1;
+  const double ns = static_cast<double>(stop.count());
+  average_ = average_ == 0 ? ns : average_ + alpha * (ns - average_);
+
+  // The smallest interval that keeps the stopped fraction within the budget,
+  // rounded up to a multiple of the base interval.
+  const double base =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(base_interval)
+          .count();
+  const double multiple = std::ceil(average_ / (budget_ * base));
+  weight_ = static_cast<uint64_t>(
+      std::max(1.0, std::min<double>(multiple, MAX_SAMPLE_WEIGHT)));
+  return weight_;
+}
+
+bool PinToCPU(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+}  // namespace pyflame
@@ -0,0 +1,91 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <random>
+
+// Maximum weight of a sample, i.e. the maximum multiple of the requested
+// interval that an overhead budget can stretch the interval to.
+#define MAX_SAMPLE_WEIGHT 1000
+
+namespace pyflame {
+
+// Decides when to take each sample. Samples are taken at absolute deadlines on
+// CLOCK_MONOTONIC, so the time spent taking a sample doesn't add to the
+// interval, and the sample rate doesn't drift below the requested rate.
+//
+// With jitter, the intervals are drawn from an exponential distribution with
+// the requested mean, so samples form a Poisson process. This keeps sampling
+// from aliasing with periodic work in the target.
+class Scheduler {
+ public:
+  Scheduler(std::chrono::microseconds interval, bool jitter);
+  Scheduler(const Scheduler &other) = delete;
+
+  // Start the schedule; the first deadline is an interval from now.
+  void Start();
+
+  // Sleep until the next deadline, or until a signal handler sets stop. If
+  // sampling has fallen more than a whole interval behind, the deadlines that
+  // were missed are skipped rather than sampled in a burst.
+  void Wait(const std::atomic<bool> &stop);
+
+  // The total number of deadlines skipped.
+  inline uint64_t missed() const { return missed_; }
+
+  // Change the (mean) interval, starting from the next deadline.
+  void set_interval(std::chrono::nanoseconds interval);
+
+ private:
+  int64_t interval_;  // Nanoseconds
+  const bool jitter_;
+  int64_t deadline_;  // Nanoseconds on CLOCK_MONOTONIC
+  uint64_t missed_;
+  std::mt19937_64 rng_;
+  std::exponential_distribution<double> exponential_;
+
+  // The length of the next interval.
+  int64_t Next();
+};
+
+// Adjusts the sampling interval to keep the fraction of time for which the
+// target is stopped under a budget. The interval is always a whole multiple of
+// the base interval (from --rate), and that multiple is the weight of each
+// sample, so that weighted sample counts stay proportional to time.
+class OverheadBudget {
+ public:
+  // budget is the maximum fraction of time to stop the target for.
+  explicit OverheadBudget(double budget)
+      : budget_(budget), average_(0), weight_(1) {}
+
+  // Record the stop time of a sample. Returns the weight for the next sample,
+  // which is the multiple of the base interval to wait for.
+  uint64_t Update(std::chrono::nanoseconds stop,
+                  std::chrono::microseconds base_interval);
+
+  inline uint64_t weight() const { return weight_; }
+
+ private:
+  const double budget_;
+  double average_;  // Moving average of the stop time, in nanoseconds
+  uint64_t weight_;
+};
+
+// Pin the calling thread to a CPU. Returns false on failure.
+bool PinToCPU(int cpu);
+}  // namespace pyflame
@@ -0,0 +1,102 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "./stacktrie.h"
+
+namespace pyflame {
+namespace {
+const uint32_t kNone = UINT32_MAX;
+
+// The finalizer from MurmurHash3. Every input bit affects every output bit, so
+// keys that differ only in one field still spread out across the buckets.
+inline uint64_t Mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+}  // namespace
+
+size_t StackTrie::EdgeHash::operator()(const Edge &edge) const {
+  const uint64_t ids = (static_cast<uint64_t>(edge.frame.file_id()) << 32) |
+                       edge.frame.name_id();
+  const uint64_t pos =
+      (static_cast<uint64_t>(edge.parent) << 32) | edge.frame.line();
+  return static_cast<size_t>(Mix(Mix(ids) ^ pos));
+}
+
+StackTrie::StackTrie() { Clear(); }
+
+void StackTrie::Add(const frames_t &frames, size_t count) {
+  uint32_t node = 0;
+  for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+    auto child = children_.find({node, *it});
+    if (child != children_.end()) {
+      node = child->second;
+      continue;
+    }
+    const uint32_t id = static_cast<uint32_t>(nodes_.size());
+    nodes_.push_back({*it, node, kNone, nodes_[node].first_child, 0});
+    nodes_[node].first_child = id;
+    children_.insert({{node, *it}, id});
+    node = id;
+  }
+  nodes_[node].count += count;
+  total_ += count;
+}
+
+void StackTrie::Print(std::ostream &out, print_frame_t print_frame,
+                      const std::string &prefix) const {
+  // Depth first traversal, keeping the path from the root to the current node.
+  std::vector<uint32_t> path;
+  uint32_t node = nodes_[0].first_child;
+  while (node != kNone) {
+    path.push_back(node);
+    const Node &n = nodes_[node];
+    if (n.count) {
+      out << prefix;
+      for (size_t i = 0; i < path.size(); i++) {
+        if (i) {
+          out << ";";
+        }
+        print_frame(out, nodes_[path[i]].frame);
+      }
+      out << " " << n.count << "\n";
+    }
+    if (n.first_child != kNone) {
+      node = n.first_child;
+      continue;
+    }
+    // Go back up until there is a sibling to visit.
+    while (!path.empty()) {
+      const uint32_t sibling = nodes_[path.back()].next_sibling;
+      path.pop_back();
+      if (sibling != kNone) {
+        node = sibling;
+        break;
+      }
+      node = kNone;
+    }
+  }
+}
+
+void StackTrie::Clear() {
+  nodes_.clear();
+  children_.clear();
+  nodes_.push_back({{0, 0, 0}, kNone, kNone, kNone, 0});
+  total_ = 0;
+}
+}  // namespace pyflame
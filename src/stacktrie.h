@@ -0,0 +1,81 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "./frame.h"
+
+namespace pyflame {
+
+// Sample counts for call stacks, stored as a call tree. Each node is a frame
+// plus the path of callers that leads to it, so stacks with a common prefix
+// share the nodes for it, and adding a stack takes O(depth) hash lookups on
+// small fixed size keys.
+class StackTrie {
+ public:
+  StackTrie();
+  StackTrie(const StackTrie &other) = delete;
+
+  // Add count samples of a stack. As everywhere else, the stack is in reverse
+  // order (most recent frame first).
+  void Add(const frames_t &frames, size_t count = 1);
+
+  // True if no stacks have been added.
+  inline bool empty() const { return total_ == 0; }
+
+  // Number of samples added.
+  inline size_t total() const { return total_; }
+
+  // Print every stack that was sampled, with its count, one per line, in the
+  // folded format that flamegraph.pl reads. Each line starts with prefix.
+  void Print(std::ostream &out, print_frame_t print_frame,
+             const std::string &prefix = "") const;
+
+  void Clear();
+
+ private:
+  struct Node {
+    Frame frame;
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t next_sibling;
+    size_t count;
+  };
+
+  struct Edge {
+    uint32_t parent;
+    Frame frame;
+
+    inline bool operator==(const Edge &other) const {
+      return parent == other.parent && frame == other.frame;
+    }
+  };
+
+  struct EdgeHash {
+    size_t operator()(const Edge &edge) const;
+  };
+
+  // Node 0 is the root, which doesn't have a frame of its own.
+  std::vector<Node> nodes_;
+  std::unordered_map<Edge, uint32_t, EdgeHash> children_;
+  size_t total_;
+};
+}  // namespace pyflame
@@ -0,0 +1,124 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "./stats.h"
+
+#include <algorithm>
+#include <iomanip>
+
+namespace pyflame {
+void Histogram::Add(std::chrono::nanoseconds duration) {
+  const uint64_t ns = static_cast<uint64_t>(std::max<int64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count(),
+      0));
+  count_++;
+  total_ += ns;
+  max_ = std::max(max_, ns);
+
+  // Bucket 0 is [0, 1) us, and bucket i is [2^(i-1), 2^i) us.
+  const uint64_t us = ns / 1000;
+  size_t bucket = 0;
+  if (us) {
+    bucket = std::min<size_t>(64 - __builtin_clzll(us), kBuckets - 1);
+  }
+  buckets_[bucket]++;
+}
+
+void Histogram::Print(std::ostream &out) const {
+  if (!count_) {
+    out << "    (none)\n";
+    return;
+  }
+  out << std::fixed << std::setprecision(1) << "    count " << count_
+      << ", mean " << total_ / 1000.0 / count_ << " us, max " << max_ / 1000.0
+      << " us\n";
+  size_t first = 0, last = kBuckets - 1;
+  while (!buckets_[first]) {
+    first++;
+  }
+  while (!buckets_[last]) {
+    last--;
+  }
+  for (size_t i = first; i <= last; i++) {
+    const uint64_t lo = i ? 1ULL << (i - 1) : 0;
+    out << "    " << std::setw(10) << lo << " - " << std::setw(10)
+        << (1ULL << i) << " us  " << std::setw(10)
+        << buckets_[i] << "  " << std::setw(5)
+        << 100.0 * buckets_[i] / count_ << "%\n";
+  }
+}
+
+void Stats::Start() { start_ = std::chrono::steady_clock::now(); }
+
+void Stats::Stop() { end_ = std::chrono::steady_clock::now(); }
+
+void Stats::Print(std::ostream &out, double requested_interval,
+                  bool nonstop) const {
+  const double elapsed =
+      std::chrono::duration_cast<std::chrono::duration<double>>(end_ - start_)
+          .count();
+  out << std::fixed << std::setprecision(1);
+  out << "pyflame stats:\n";
+  out << "  duration            " << std::setprecision(3) << elapsed
+      << " s\n"
+      << std::setprecision(1);
+  out << "  samples             " << samples;
+  if (elapsed > 0) {
+    out << " (" << samples / elapsed << "/s";
+    if (requested_interval > 0) {
+      out << ", requested " << targets / requested_interval << "/s";
+    }
+    out << ")";
+  }
+  out << "\n";
+  out << "  weighted samples    " << weighted << "\n";
+  out << "  missed ticks        " << missed << "\n";
+  out << "  dropped samples     " << dropped << "\n";
+  out << "  failed samples      " << failed << "\n";
+  out << "  idle samples        " << idle << "\n";
+  out << "  thread stacks       " << threads << "\n";
+  out << "  partial stacks      " << partial << "\n";
+  out << "  truncated stacks    " << truncated << "\n";
+  if (samples) {
+    out << "  reads per sample    " << static_cast<double>(reads) / samples
+        << "\n";
+    out << "  bytes per sample    " << static_cast<double>(bytes) / samples
+        << "\n";
+  }
+  out << "  allocations         " << allocations;
+  if (allocations) {
+    out << " (on " << allocating_ticks << " ticks, the last by sample "
+        << last_allocating << ")";
+  }
+  out << "\n";
+  out << "  target stop time per sample:\n";
+  if (nonstop) {
+    out << "    (not stopped, --nonstop)\n";
+  } else {
+    stop_time.Print(out);
+    if (elapsed > 0) {
+      const double stopped =
+          std::chrono::duration_cast<std::chrono::duration<double>>(
+              stop_time.total())
+              .count();
+      // With several targets, each is only stopped for its own samples.
+      out << std::setprecision(2) << "    stopped for "
+          << 100 * stopped / elapsed / targets << "% of the time\n"
+          << std::setprecision(1);
+    }
+  }
+  out << "  walk time per thread:\n";
+  walk_time.Print(out);
+}
+}  // namespace pyflame
@@ -0,0 +1,107 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+namespace pyflame {
+
+// A histogram of durations, in power of two buckets of microseconds.
+class Histogram {
+ public:
+  Histogram() : count_(0), total_(0), max_(0), buckets_() {}
+
+  void Add(std::chrono::nanoseconds duration);
+
+  inline uint64_t count() const { return count_; }
+
+  // The sum of the durations.
+  inline std::chrono::nanoseconds total() const {
+    return std::chrono::nanoseconds(total_);
+  }
+
+  // Print the summary and the non-empty range of buckets, one per line.
+  void Print(std::ostream &out) const;
+
+ private:
+  static const size_t kBuckets = 32;
+
+  uint64_t count_;
+  uint64_t total_;     // Nanoseconds
+  uint64_t max_;       // Nanoseconds
+  uint64_t buckets_[kBuckets];
+};
+
+// Measurements of how much work pyflame did, and how long it stopped the
+// target for, which are printed at exit with --stats.
+class Stats {
+ public:
+  Stats()
+      : samples(0),
+        failed(0),
+        idle(0),
+        threads(0),
+        partial(0),
+        truncated(0),
+        reads(0),
+        bytes(0),
+        missed(0),
+        dropped(0),
+        weighted(0),
+        targets(1),
+        allocations(0),
+        allocating_ticks(0),
+        last_allocating(0) {}
+  Stats(const Stats &other) = delete;
+
+  // Called when sampling starts and ends.
+  void Start();
+  void Stop();
+
+  void Print(std::ostream &out, double requested_interval, bool nonstop) const;
+
+  // Time from the target being stopped until it was continued, per sample.
+  Histogram stop_time;
+
+  // Time to walk the stack of a thread.
+  Histogram walk_time;
+
+  uint64_t samples;    // Attempted samples, including failed ones
+  uint64_t failed;     // Samples that failed with an error
+  uint64_t idle;       // Samples with no thread holding a frame
+  uint64_t threads;    // Thread stacks walked
+  uint64_t partial;    // Stacks truncated by --max-depth or a loop
+  uint64_t truncated;  // Stacks cut short by a frame that couldn't be read
+  uint64_t reads;      // Remote memory reads
+  uint64_t bytes;      // Bytes read from remote memory
+  uint64_t missed;     // Deadlines skipped because sampling fell behind
+  uint64_t dropped;    // Samples skipped because aggregation fell behind
+  uint64_t weighted;   // Samples, weighted by the interval each stands for
+  uint64_t targets;    // Processes sampled on each tick
+
+  // Heap allocations made by the sampling loop, the number of ticks on which
+  // there were any, and the number of samples taken by the end of the last one.
+  uint64_t allocations;
+  uint64_t allocating_ticks;
+  uint64_t last_allocating;
+
+ private:
+  std::chrono::steady_clock::time_point start_;
+  std::chrono::steady_clock::time_point end_;
+};
+}  // namespace pyflame
@@ -0,0 +1,44 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "./stringtable.h"
+
+namespace pyflame {
+uint32_t StringTable::Intern(const std::string &str) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = ids_.find(str);
+  if (it != ids_.end()) {
+    return it->second;
+  }
+  const uint32_t id = static_cast<uint32_t>(strings_.size());
+  it = ids_.insert({str, id}).first;
+  strings_.push_back(&it->first);
+  return id;
+}
+
+const std::string &StringTable::Lookup(uint32_t id) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return *strings_.at(id);
+}
+
+size_t StringTable::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return strings_.size();
+}
+
+StringTable &Strings() {
+  static StringTable table;
+  return table;
+}
+}  // namespace pyflame
@@ -0,0 +1,54 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace pyflame {
+
+// A table of interned strings. Every distinct string is stored once, and is
+// identified by a small integer id, so frames can be stored and compared as
+// ids; only the output code needs to turn them back into text. Ids are never
+// reused, so they stay valid for the life of the table.
+//
+// This is safe to use from multiple threads.
+class StringTable {
+ public:
+  StringTable() {}
+  StringTable(const StringTable &other) = delete;
+
+  // Get the id for str, adding it to the table if necessary.
+  uint32_t Intern(const std::string &str);
+
+  // Get the string for an id returned by Intern().
+  const std::string &Lookup(uint32_t id) const;
+
+  size_t size() const;
+
+ private:
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, uint32_t> ids_;
+
+  // Indexed by id; these point at the keys of ids_, which don't move.
+  std::vector<const std::string *> strings_;
+};
+
+// The table that all frames in the process use.
+StringTable &Strings();
+}  // namespace pyflame
@@ -48,6 +48,9 @@ void ELF::Open(const std::string &target, Namespace *ns) {
     ss << "Failed to open ELF file " << target << ": " << strerror(errno);
     throw FatalException(ss.str());
   }
+  struct stat st;
+  Fstat(fd, &st);
+  id_ = ELFId{st.st_dev, st.st_ino, st.st_size, st.st_mtime, ""};
   length_ = lseek(fd, 0, SEEK_END);
   addr_ = mmap(nullptr, length_, PROT_READ, MAP_SHARED, fd, 0);
   pyflame::Close(fd);
@@ -95,6 +98,11 @@ void ELF::Parse() {
       case SHT_SYMTAB:
         symtab_ = i;
         break;
+      case SHT_NOTE:
+        if (strcmp(strtab(s->sh_name), ".note.gnu.build-id") == 0) {
+          ReadBuildId(s);
+        }
+        break;
     }
   }
   if (dynamic_ == -1) {
@@ -122,6 +130,36 @@ std::vector<std::string> ELF::NeededLibs() {
   return needed;
 }
 
+void ELF::ReadBuildId(const shdr_t *notes) {
+  static const char hex[] = "0123456789abcdef";
+  size_t off = 0;
+  while (off + sizeof(nhdr_t) <= notes->sh_size) {
+    const nhdr_t *note =
+        reinterpret_cast<const nhdr_t *>(p() + notes->sh_offset + off);
+    // The name and the descriptor are each padded to a multiple of 4 bytes.
+    const size_t name_off = off + sizeof(nhdr_t);
+    const size_t desc_off = name_off + ((note->n_namesz + 3) & ~3UL);
+    const size_t end = desc_off + ((note->n_descsz + 3) & ~3UL);
+    if (end > notes->sh_size) {
+      break;
+    }
+    const char *name =
+        reinterpret_cast<const char *>(p() + notes->sh_offset + name_off);
+    if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 &&
+        memcmp(name, "GNU", 4) == 0) {
+      const uint8_t *desc =
+          reinterpret_cast<const uint8_t *>(p() + notes->sh_offset + desc_off);
+      id_.build_id.clear();
+      for (size_t i = 0; i < note->n_descsz; i++) {
+        id_.build_id.push_back(hex[desc[i] >> 4]);
+        id_.build_id.push_back(hex[desc[i] & 0xf]);
+      }
+      return;
+    }
+    off = end;
+  }
+}
+
 PyABI ELF::WalkTable(int sym, int str, PyAddresses *addrs) {
   PyABI abi{};
   bool have_abi = false;
@@ -129,7 +167,8 @@ PyABI ELF::WalkTable(int sym, int str, PyAddresses *addrs) {
   const shdr_t *d = shdr(str);
   for (uint16_t i = 0; i < s->sh_size / s->sh_entsize; i++) {
     if (have_abi && addrs->tstate_addr && addrs->interp_head_addr &&
-        addrs->interp_head_fn_addr) {
+        addrs->interp_head_fn_addr && addrs->frame_type_addr &&
+        addrs->code_type_addr) {
       break;
     }
 
@@ -144,6 +183,10 @@ PyABI ELF::WalkTable(int sym, int str, PyAddresses *addrs) {
     } else if (!addrs->interp_head_addr &&
                strcmp(name, "PyInterpreterState_Head") == 0) {
       addrs->interp_head_fn_addr = static_cast<unsigned long>(sym->st_value);
+    } else if (!addrs->frame_type_addr && strcmp(name, "PyFrame_Type") == 0) {
+      addrs->frame_type_addr = static_cast<unsigned long>(sym->st_value);
+    } else if (!addrs->code_type_addr && strcmp(name, "PyCode_Type") == 0) {
+      addrs->code_type_addr = static_cast<unsigned long>(sym->st_value);
     } else if (!have_abi) {
       if (strcmp(name, "PyString_Type") == 0) {
         // If we find PyString_Type, this is some kind of Python 2.
@@ -15,11 +15,14 @@
 #pragma once
 
 #include <elf.h>
+#include <sys/types.h>
 
 #include <limits.h>
+#include <ctime>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <tuple>
 #include <vector>
 
 #include "./config.h"
@@ -32,6 +35,7 @@
 #define shdr_t Elf64_Shdr
 #define dyn_t Elf64_Dyn
 #define sym_t Elf64_Sym
+#define nhdr_t Elf64_Nhdr
 #define addr_t Elf64_Addr
 #define ARCH_ELFCLASS ELFCLASS64
 #else
@@ -40,6 +44,7 @@
 #define shdr_t Elf32_Shdr
 #define dyn_t Elf32_Dyn
 #define sym_t Elf32_Sym
+#define nhdr_t Elf32_Nhdr
 #define addr_t Elf32_Addr
 #define ARCH_ELFCLASS ELFCLASS32
 #endif
@@ -62,6 +67,8 @@ struct PyAddresses {
   unsigned long interp_head_addr;
   unsigned long interp_head_fn_addr;
   unsigned long interp_head_hint;
+  unsigned long frame_type_addr;
+  unsigned long code_type_addr;
   bool pie;
 
   PyAddresses()
@@ -69,6 +76,8 @@ struct PyAddresses {
         interp_head_addr(0),
         interp_head_fn_addr(0),
         interp_head_hint(0),
+        frame_type_addr(0),
+        code_type_addr(0),
         pie(false) {}
 
   PyAddresses operator-(const unsigned long base) const {
@@ -78,6 +87,10 @@ struct PyAddresses {
         this->interp_head_addr == 0 ? 0 : this->interp_head_addr - base;
     res.interp_head_fn_addr =
         this->interp_head_fn_addr == 0 ? 0 : this->interp_head_fn_addr - base;
+    res.frame_type_addr =
+        this->frame_type_addr == 0 ? 0 : this->frame_type_addr - base;
+    res.code_type_addr =
+        this->code_type_addr == 0 ? 0 : this->code_type_addr - base;
     return res;
   }
 
@@ -88,6 +101,10 @@ struct PyAddresses {
         this->interp_head_addr == 0 ? 0 : this->interp_head_addr + base;
     res.interp_head_fn_addr =
         this->interp_head_fn_addr == 0 ? 0 : this->interp_head_fn_addr + base;
+    res.frame_type_addr =
+        this->frame_type_addr == 0 ? 0 : this->frame_type_addr + base;
+    res.code_type_addr =
+        this->code_type_addr == 0 ? 0 : this->code_type_addr + base;
     return res;
   }
 
@@ -98,6 +115,22 @@ struct PyAddresses {
   inline bool empty() const { return this->tstate_addr == 0; }
 };
 
+// Identifies the contents of an ELF file. Processes running the same executable
+// or library have the same symbols, so they only have to be looked up once.
+struct ELFId {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+  std::string build_id;  // The hex encoded NT_GNU_BUILD_ID note, if any
+
+  inline bool operator<(const ELFId &other) const {
+    return std::tie(dev, ino, size, mtime, build_id) <
+           std::tie(other.dev, other.ino, other.size, other.mtime,
+                    other.build_id);
+  }
+};
+
 // Representation of an ELF file.
 class ELF {
  public:
@@ -108,7 +141,8 @@ class ELF {
         dynstr_(-1),
         dynsym_(-1),
         strtab_(-1),
-        symtab_(-1) {}
+        symtab_(-1),
+        id_{} {}
   ~ELF() { Close(); }
 
   // Open a file
@@ -130,10 +164,14 @@ class ELF {
   // Extract the base load address from the Program Header table
   addr_t GetBaseAddress();
 
+  // The identity of the file. The build id is only set after Parse().
+  inline const ELFId &id() const { return id_; }
+
  private:
   void *addr_;
   size_t length_;
   int dynamic_, dynstr_, dynsym_, strtab_, symtab_;
+  ELFId id_;
 
   inline const ehdr_t *hdr() const {
     return reinterpret_cast<const ehdr_t *>(addr_);
@@ -173,6 +211,9 @@ class ELF {
     return reinterpret_cast<const char *>(p() + strings->sh_offset + offset);
   }
 
+  // Read the build id from a SHT_NOTE section.
+  void ReadBuildId(const shdr_t *notes);
+
   // Walk the symbol table, and return the detected ABI.
   PyABI WalkTable(int sym, int str, PyAddresses *addrs);
 };
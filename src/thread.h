@@ -28,19 +28,28 @@ namespace pyflame {
 
 class Thread {
  public:
-  Thread() = delete;
+  Thread() : id_(0), is_current_(false) {}
   Thread(const Thread &other)
       : id_(other.id_),
         is_current_(other.is_current_),
         frames_(other.frames_) {}
+  Thread(Thread &&other) = default;
   Thread(const unsigned long id, const bool is_current,
-         const std::vector<Frame> frames)
+         const std::vector<Frame> &frames)
       : id_(id), is_current_(is_current), frames_(frames) {}
 
   inline const unsigned long id() const { return id_; }
   inline const bool is_current() const { return is_current_; }
   inline const std::vector<Frame> &frames() const { return frames_; }
 
+  // Reuse this object for a new sample. The frame vector keeps its capacity.
+  inline void Reset(const unsigned long id, const bool is_current) {
+    id_ = id;
+    is_current_ = is_current;
+    frames_.clear();
+  }
+  inline std::vector<Frame> *mutable_frames() { return &frames_; }
+
   inline bool operator==(const Thread &other) const {
     return id_ == other.id_ && is_current_ == other.is_current_ &&
            frames_ == other.frames_;
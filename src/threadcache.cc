@@ -0,0 +1,78 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "./threadcache.h"
+
+#include <algorithm>
+
+namespace pyflame {
+void ThreadCache::Begin(FrameDetail detail) {
+  if (detail != detail_) {
+    // The frames from the previous walk were decoded differently.
+    previous_.clear();
+    frames_.clear();
+    index_.clear();
+    detail_ = detail;
+  }
+  current_.clear();
+}
+
+ssize_t ThreadCache::Find(const FrameRecord &record) const {
+  auto it = std::lower_bound(
+      index_.begin(), index_.end(), record.addr,
+      [](const std::pair<unsigned long, size_t> &entry, unsigned long addr) {
+        return entry.first < addr;
+      });
+  if (it == index_.end() || it->first != record.addr ||
+      !Matches(it->second, record)) {
+    return -1;
+  }
+  return static_cast<ssize_t>(it->second);
+}
+
+bool ThreadCache::Matches(size_t i, const FrameRecord &record) const {
+  if (i >= previous_.size()) {
+    return false;
+  }
+  const FrameRecord &prev = previous_[i];
+  if (prev.addr != record.addr || prev.back != record.back ||
+      prev.code != record.code) {
+    return false;
+  }
+  // Without line numbers the position within the function doesn't matter.
+  return detail_ == FrameDetail::Function ||
+         (prev.lasti == record.lasti && prev.lineno == record.lineno);
+}
+
+void ThreadCache::Splice(size_t i, std::vector<Frame> *stack) {
+  current_.insert(current_.end(), previous_.begin() + i, previous_.end());
+  stack->insert(stack->end(), frames_.begin() + i, frames_.end());
+}
+
+void ThreadCache::Finish(const std::vector<Frame> &stack, bool complete) {
+  index_.clear();
+  if (complete) {
+    previous_.swap(current_);
+    frames_ = stack;
+    for (size_t i = 0; i < previous_.size(); i++) {
+      index_.push_back({previous_[i].addr, i});
+    }
+    std::sort(index_.begin(), index_.end());
+  } else {
+    previous_.clear();
+    frames_.clear();
+  }
+  current_.clear();
+}
+}  // namespace pyflame
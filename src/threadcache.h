@@ -0,0 +1,94 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "./frame.h"
+
+namespace pyflame {
+
+// The fields of a remote frame object that determine what the walker decodes
+// for it. If all of these are unchanged, the decoded frame is unchanged.
+struct FrameRecord {
+  unsigned long addr;  // Remote address of the frame object
+  unsigned long back;  // f_back
+  unsigned long code;  // f_code
+  int lasti;           // f_lasti
+  int lineno;          // f_lineno
+};
+
+// The stack of a thread as it was walked in the previous sample.
+//
+// The outer frames of a thread (e.g. a server's main loop, the WSGI app, and
+// middleware) usually don't change between samples. When the walker reaches a
+// frame that is still at the same address, still linked to the same parent,
+// and still at the same instruction as in the previous sample, the rest of the
+// stack can be copied from the previous sample instead of being read again.
+class ThreadCache {
+ public:
+  ThreadCache() : last_sample(0), detail_(FrameDetail::Line) {}
+  ThreadCache(const ThreadCache &other) = delete;
+  ThreadCache(ThreadCache &&other) = default;
+
+  // Start recording a new walk, made with the given level of detail.
+  void Begin(FrameDetail detail);
+
+  // Record the next frame of the walk in progress.
+  inline void Add(const FrameRecord &record) { current_.push_back(record); }
+
+  // Find the frame at record.addr in the previous walk, and check that it's
+  // unchanged. Returns the index of the frame in the previous walk, or -1.
+  ssize_t Find(const FrameRecord &record) const;
+
+  // Check that the frame at index i of the previous walk is unchanged.
+  bool Matches(size_t i, const FrameRecord &record) const;
+
+  // Copy the frames of the previous walk from index i onwards to the end of the
+  // walk in progress, and onto the end of stack.
+  void Splice(size_t i, std::vector<Frame> *stack);
+
+  // Finish the walk in progress. If the walk was complete, it becomes the
+  // previous walk for the next sample; otherwise the cache is emptied.
+  void Finish(const std::vector<Frame> &stack, bool complete);
+
+  // Fill in frame i of the previous walk, which was left as a placeholder to
+  // be decoded after the walk finished.
+  inline void Resolve(size_t i, const Frame &frame) {
+    if (i < frames_.size()) {
+      frames_[i] = frame;
+    }
+  }
+
+  inline size_t size() const { return previous_.size(); }
+
+  // The sample number in which this thread was last seen.
+  uint64_t last_sample;
+
+ private:
+  FrameDetail detail_;
+  std::vector<FrameRecord> previous_;
+  std::vector<FrameRecord> current_;
+  std::vector<Frame> frames_;
+
+  // (address, index) pairs for the previous walk, sorted by address.
+  std::vector<std::pair<unsigned long, size_t>> index_;
+};
+}  // namespace pyflame
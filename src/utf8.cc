@@ -0,0 +1,232 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "./utf8.h"
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace pyflame {
+namespace {
+// Encode a single code point, returning the position after it, or nullptr if
+// ch isn't a code point. This is the same logic as CPython's
+// STRINGLIB(utf8_encoder), without the surrogate handling: CPython uses UCS-4
+// rather than surrogate pairs for characters outside the BMP.
+inline char *EncodeChar(uint32_t ch, char *p) {
+  if (ch < 0x80) {
+    *p++ = static_cast<char>(ch);
+  } else if (ch < 0x0800) {
+    *p++ = static_cast<char>(0xc0 | (ch >> 6));
+    *p++ = static_cast<char>(0x80 | (ch & 0x3f));
+  } else if (ch < 0x10000) {
+    *p++ = static_cast<char>(0xe0 | (ch >> 12));
+    *p++ = static_cast<char>(0x80 | ((ch >> 6) & 0x3f));
+    *p++ = static_cast<char>(0x80 | (ch & 0x3f));
+  } else if (ch <= 0x10ffff) {  // Maximum code point of Unicode 6.0
+    *p++ = static_cast<char>(0xf0 | (ch >> 18));
+    *p++ = static_cast<char>(0x80 | ((ch >> 12) & 0x3f));
+    *p++ = static_cast<char>(0x80 | ((ch >> 6) & 0x3f));
+    *p++ = static_cast<char>(0x80 | (ch & 0x3f));
+  } else {
+    return nullptr;
+  }
+  return p;
+}
+
+// The ASCII loops copy the leading ASCII characters of src to dst, and return
+// how many there were. There is one for each code unit size, in scalar, SSE2,
+// and AVX2 versions; the vector versions finish off with the scalar one.
+template <typename T>
+size_t AsciiScalar(const T *src, size_t n, char *dst) {
+  size_t i = 0;
+  for (; i < n && src[i] < 0x80; i++) {
+    dst[i] = static_cast<char>(src[i]);
+  }
+  return i;
+}
+
+#if defined(__x86_64__)
+// True if any bit of mask is set in v.
+inline bool AnySSE2(__m128i v, __m128i mask) {
+  const __m128i masked = _mm_and_si128(v, mask);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(masked, _mm_setzero_si128())) !=
+         0xffff;
+}
+
+size_t AsciiSSE2(const uint8_t *src, size_t n, char *dst) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const __m128i v =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    if (_mm_movemask_epi8(v)) {
+      break;
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), v);
+  }
+  return i + AsciiScalar(src + i, n - i, dst + i);
+}
+
+size_t AsciiSSE2(const uint16_t *src, size_t n, char *dst) {
+  const __m128i mask = _mm_set1_epi16(static_cast<int16_t>(0xff80));
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m128i v =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    if (AnySSE2(v, mask)) {
+      break;
+    }
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(dst + i),
+                     _mm_packus_epi16(v, v));
+  }
+  return i + AsciiScalar(src + i, n - i, dst + i);
+}
+
+size_t AsciiSSE2(const uint32_t *src, size_t n, char *dst) {
+  const __m128i mask = _mm_set1_epi32(static_cast<int32_t>(0xffffff80));
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const __m128i v =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    if (AnySSE2(v, mask)) {
+      break;
+    }
+    const __m128i words = _mm_packs_epi32(v, v);
+    const int32_t bytes = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+    memcpy(dst + i, &bytes, sizeof(bytes));
+  }
+  return i + AsciiScalar(src + i, n - i, dst + i);
+}
+
+// The 256-bit pack instructions work within each 128-bit lane, so the packed
+// results are permuted to bring the two halves together.
+__attribute__((target("avx2"))) size_t AsciiAVX2(const uint8_t *src, size_t n,
+                                                 char *dst) {
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    const __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+    if (_mm256_movemask_epi8(v)) {
+      break;
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), v);
+  }
+  return i + AsciiScalar(src + i, n - i, dst + i);
+}
+
+__attribute__((target("avx2"))) size_t AsciiAVX2(const uint16_t *src,
+                                                 size_t n, char *dst) {
+  const __m256i mask = _mm256_set1_epi16(static_cast<int16_t>(0xff80));
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+    if (!_mm256_testz_si256(v, mask)) {
+      break;
+    }
+    const __m256i packed =
+        _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0x08);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                     _mm256_castsi256_si128(packed));
+  }
+  return i + AsciiScalar(src + i, n - i, dst + i);
+}
+
+__attribute__((target("avx2"))) size_t AsciiAVX2(const uint32_t *src,
+                                                 size_t n, char *dst) {
+  const __m256i mask = _mm256_set1_epi32(static_cast<int32_t>(0xffffff80));
+  const __m256i order = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+    if (!_mm256_testz_si256(v, mask)) {
+      break;
+    }
+    const __m256i words = _mm256_packs_epi32(v, v);
+    const __m256i packed = _mm256_permutevar8x32_epi32(
+        _mm256_packus_epi16(words, words), order);
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(dst + i),
+                     _mm256_castsi256_si128(packed));
+  }
+  return i + AsciiScalar(src + i, n - i, dst + i);
+}
+#endif
+
+template <typename T>
+struct AsciiFunc {
+  typedef size_t (*type)(const T *, size_t, char *);
+};
+
+// Pick the best ASCII loop for this CPU.
+template <typename T>
+typename AsciiFunc<T>::type SelectAscii() {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2")) {
+    return static_cast<typename AsciiFunc<T>::type>(AsciiAVX2);
+  }
+  return static_cast<typename AsciiFunc<T>::type>(AsciiSSE2);
+#else
+  return AsciiScalar<T>;
+#endif
+}
+
+template <typename T>
+bool Encode(const T *src, size_t n, std::string *out) {
+  static const typename AsciiFunc<T>::type ascii = SelectAscii<T>();
+
+  // Latin-1 characters take at most two bytes in UTF-8, UCS-2 characters three,
+  // and UCS-4 characters four.
+  out->resize(n * (sizeof(T) == 1 ? 2 : sizeof(T) == 2 ? 3 : 4));
+  if (n == 0) {
+    return true;
+  }
+  char *const begin = &(*out)[0];
+  char *p = begin;
+  size_t i = 0;
+  while (i < n) {
+    const size_t run = ascii(src + i, n - i, p);
+    i += run;
+    p += run;
+    if (i < n) {
+      p = EncodeChar(src[i++], p);
+      if (p == nullptr) {
+        out->clear();
+        return false;
+      }
+    }
+  }
+  out->resize(p - begin);
+  return true;
+}
+}  // namespace
+
+bool EncodeUTF8(const void *data, size_t length, unsigned int kind,
+                std::string *out) {
+  switch (kind) {
+    case 1:
+      return Encode(static_cast<const uint8_t *>(data), length, out);
+    case 2:
+      return Encode(static_cast<const uint16_t *>(data), length, out);
+    case 4:
+      return Encode(static_cast<const uint32_t *>(data), length, out);
+    default:
+      // The WCHAR kind is never used for compact strings.
+      out->clear();
+      return false;
+  }
+}
+}  // namespace pyflame
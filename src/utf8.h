@@ -0,0 +1,32 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace pyflame {
+
+// Encode the data of a PEP 393 string as UTF-8, replacing the contents of out.
+// The data is length code units of kind bytes each: 1 for Latin-1, 2 for UCS-2,
+// and 4 for UCS-4. Runs of ASCII characters, which is almost everything in file
+// and function names, are converted a vector at a time, using AVX2 if the CPU
+// has it and SSE2 otherwise. Returns false, leaving out empty, if kind isn't one
+// of these or the data has a character beyond U+10FFFF; a string read out of a
+// running process may be garbage.
+bool EncodeUTF8(const void *data, size_t length, unsigned int kind,
+                std::string *out);
+}  // namespace pyflame
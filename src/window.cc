@@ -0,0 +1,212 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "./window.h"
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <utility>
+
+namespace pyflame {
+namespace {
+// The root frame under which the stacks of a process are printed with
+// --per-pid.
+std::string PidPrefix(pid_t pid) {
+  std::ostringstream os;
+  os << "(pid " << pid << ");";
+  return os.str();
+}
+
+// Prints all stack traces
+void PrintFrames(std::ostream &out, const StackTrie &stacks, size_t idle_count,
+                 size_t failed_count, bool include_line_number,
+                 const std::string &prefix) {
+  // Choose function to print frame
+  print_frame_t print_frame_ =
+      include_line_number ? print_frame : print_frame_without_line_number;
+
+  if (idle_count) {
+    out << prefix << "(idle) " << idle_count << "\n";
+  }
+  if (failed_count) {
+    out << prefix << "(failed) " << failed_count << "\n";
+  }
+  stacks.Print(out, print_frame_, prefix);
+}
+
+// Prints all stack traces with timestamps
+void PrintFramesTS(std::ostream &out, const std::vector<FrameTS> &call_stacks,
+                   bool include_line_number, bool per_pid) {
+  // Choose function to print frame
+  print_frame_t print_frame_ =
+      include_line_number ? print_frame : print_frame_without_line_number;
+
+  for (const auto &call_stack : call_stacks) {
+    out << std::chrono::duration_cast<std::chrono::microseconds>(
+               call_stack.ts.time_since_epoch())
+               .count()
+        << "\n";
+    if (per_pid) {
+      out << PidPrefix(call_stack.pid);
+    }
+    if (call_stack.failed) {
+      out << "(failed)\n";
+      continue;
+    }
+    // Handle idle
+    if (call_stack.frames.empty()) {
+      out << "(idle)\n";
+      continue;
+    }
+    // Print the call stack
+    for (auto it = call_stack.frames.rbegin(); it != call_stack.frames.rend();
+         ++it) {
+      print_frame_(out, *it);
+      out << ";";
+    }
+    out << "\n";
+  }
+}
+
+// The name of the file for a window that started at start, e.g.
+// pyflame-20180102T030405.678Z.txt. Names sort in time order.
+std::string WindowFileName(std::chrono::system_clock::time_point start) {
+  const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      start.time_since_epoch())
+                      .count();
+  const time_t secs = static_cast<time_t>(ms / 1000);
+  struct tm tm;
+  gmtime_r(&secs, &tm);
+  char buf[64];
+  const size_t len = strftime(buf, sizeof(buf), "%Y%m%dT%H%M%S", &tm);
+  snprintf(buf + len, sizeof(buf) - len, ".%03dZ", static_cast<int>(ms % 1000));
+  return std::string("pyflame-") + buf + ".txt";
+}
+}  // namespace
+
+void Window::Swap(Window *other) {
+  std::swap(start, other->start);
+  profiles.swap(other->profiles);
+  pids.swap(other->pids);
+  call_stacks.swap(other->call_stacks);
+}
+
+void Window::Clear() {
+  profiles.clear();
+  pids.clear();
+  call_stacks.clear();
+}
+
+void PrintWindow(std::ostream &out, const Window &window,
+                 const OutputFormat &format) {
+  if (format.include_ts) {
+    PrintFramesTS(out, window.call_stacks, format.include_line_number,
+                  format.per_pid);
+    return;
+  }
+  for (size_t i = 0; i < window.profiles.size(); i++) {
+    const Profile &profile = window.profiles[i];
+    if (!profile.stacks.empty() || profile.idle_count ||
+        profile.failed_count) {
+      PrintFrames(out, profile.stacks, profile.idle_count,
+                  profile.failed_count, format.include_line_number,
+                  format.per_pid ? PidPrefix(window.pids[i]) : "");
+    }
+  }
+}
+
+WindowWriter::WindowWriter(const std::string &dir, size_t retain,
+                           const OutputFormat &format)
+    : dir_(dir),
+      retain_(retain),
+      format_(format),
+      has_pending_(false),
+      done_(false) {
+  thread_ = std::thread(&WindowWriter::Run, this);
+}
+
+WindowWriter::~WindowWriter() { Finish(); }
+
+void WindowWriter::Submit(Window *window) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cond_.wait(lock, [this] { return !has_pending_; });
+  pending_.Swap(window);
+  has_pending_ = true;
+  cond_.notify_all();
+}
+
+void WindowWriter::Finish() {
+  if (!thread_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    done_ = true;
+  }
+  cond_.notify_all();
+  thread_.join();
+}
+
+void WindowWriter::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    cond_.wait(lock, [this] { return has_pending_ || done_; });
+    if (!has_pending_) {
+      return;
+    }
+    lock.unlock();
+    Write(pending_);
+    pending_.Clear();
+    lock.lock();
+    has_pending_ = false;
+    cond_.notify_all();
+  }
+}
+
+void WindowWriter::Write(const Window &window) {
+  const std::string path = dir_ + "/" + WindowFileName(window.start);
+  const std::string tmp_path = path + ".tmp";
+  {
+    std::ofstream out(tmp_path, std::ios::out | std::ios::trunc);
+    if (out.is_open()) {
+      PrintWindow(out, window, format_);
+      out.close();
+    }
+    if (!out) {
+      std::cerr << "Failed to write \"" << tmp_path << "\"\n";
+      unlink(tmp_path.c_str());
+      return;
+    }
+  }
+  // Readers of the directory only ever see complete files.
+  if (rename(tmp_path.c_str(), path.c_str())) {
+    std::cerr << "Failed to rename \"" << tmp_path << "\" to \"" << path
+              << "\": " << strerror(errno) << "\n";
+    unlink(tmp_path.c_str());
+    return;
+  }
+  written_.push_back(path);
+  while (retain_ && written_.size() > retain_) {
+    unlink(written_.front().c_str());
+    written_.pop_front();
+  }
+}
+}  // namespace pyflame
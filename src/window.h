@@ -0,0 +1,119 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./frame.h"
+#include "./stacktrie.h"
+
+namespace pyflame {
+
+// The samples taken from one process, or from all of them.
+struct Profile {
+  Profile() : idle_count(0), failed_count(0) {}
+
+  StackTrie stacks;
+  size_t idle_count;
+  size_t failed_count;
+};
+
+// The samples taken during a span of time: the whole run, or one window of
+// --window.
+struct Window {
+  std::chrono::system_clock::time_point start;
+
+  // With --per-pid there's a profile for each process, and pids has the PID
+  // for each of them; otherwise there's a single profile.
+  std::deque<Profile> profiles;
+  std::vector<pid_t> pids;
+
+  // With --flamechart, the stacks are kept in the order they were sampled.
+  std::vector<FrameTS> call_stacks;
+
+  // Exchange the contents of two windows. This doesn't copy any samples.
+  void Swap(Window *other);
+
+  // Remove all samples.
+  void Clear();
+};
+
+// How a window is printed.
+struct OutputFormat {
+  bool include_ts;           // --flamechart
+  bool include_line_number;  // Not --no-line-numbers
+  bool per_pid;
+};
+
+// Print the samples of a window, in the format that flamegraph.pl reads (or,
+// with timestamps, the format that flame-chart-json reads).
+void PrintWindow(std::ostream &out, const Window &window,
+                 const OutputFormat &format);
+
+// Writes the windows of --window to timestamped files in a directory, on a
+// thread of its own.
+//
+// The windows are double buffered: the sampling loop fills in one window while
+// the previous one is written out, so writing a window doesn't stop sampling.
+// Sampling only waits if a window hasn't been written by the time the next one
+// ends. At most two windows are held in memory.
+class WindowWriter {
+ public:
+  // Keep the retain most recent files that were written, or all of them if
+  // retain is 0.
+  WindowWriter(const std::string &dir, size_t retain,
+               const OutputFormat &format);
+  WindowWriter(const WindowWriter &other) = delete;
+  ~WindowWriter();
+
+  // Hand a finished window over to be written, and replace it with an empty
+  // window to fill in.
+  void Submit(Window *window);
+
+  // Wait for the windows that were submitted to be written, and stop the
+  // thread.
+  void Finish();
+
+ private:
+  const std::string dir_;
+  const size_t retain_;
+  const OutputFormat format_;
+
+  // pending_ belongs to the writer thread while has_pending_ is set.
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  Window pending_;
+  bool has_pending_;
+  bool done_;
+  std::thread thread_;
+
+  // The files written so far, oldest first.
+  std::deque<std::string> written_;
+
+  void Run();
+
+  void Write(const Window &window);
+};
+}  // namespace pyflame
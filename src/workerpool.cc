@@ -0,0 +1,95 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "./workerpool.h"
+
+#include "./alloccount.h"
+
+namespace pyflame {
+WorkerPool::WorkerPool(size_t size)
+    : call_(nullptr),
+      fn_(nullptr),
+      n_(0),
+      next_(0),
+      batch_(0),
+      busy_(0),
+      stop_(false),
+      allocations_(0) {
+  for (size_t i = 1; i < size; i++) {
+    threads_.emplace_back(&WorkerPool::Loop, this, i);
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  start_.notify_all();
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+}
+
+void WorkerPool::RunBatch(size_t n, call_t call, const void *fn) {
+  if (threads_.empty() || n < 2) {
+    for (size_t i = 0; i < n; i++) {
+      call(fn, 0, i);
+    }
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    call_ = call;
+    fn_ = fn;
+    n_ = n;
+    next_.store(0, std::memory_order_relaxed);
+    busy_ = threads_.size();
+    batch_++;
+  }
+  start_.notify_all();
+  Work(0);
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_.wait(lock, [this] { return busy_ == 0; });
+}
+
+void WorkerPool::Work(size_t worker) {
+  for (size_t i = next_.fetch_add(1, std::memory_order_relaxed); i < n_;
+       i = next_.fetch_add(1, std::memory_order_relaxed)) {
+    call_(fn_, worker, i);
+  }
+}
+
+void WorkerPool::Loop(size_t worker) {
+  uint64_t batch = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      start_.wait(lock, [this, batch] { return stop_ || batch_ != batch; });
+      if (stop_) {
+        return;
+      }
+      batch = batch_;
+    }
+    const uint64_t allocations = ThreadAllocations();
+    Work(worker);
+    allocations_.fetch_add(ThreadAllocations() - allocations,
+                           std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--busy_ == 0) {
+      done_.notify_one();
+    }
+  }
+}
+}  // namespace pyflame
@@ -0,0 +1,91 @@
+// Copyright 2018 Uber Technologies, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace pyflame {
+
+// A fixed set of threads that run batches of independent calls, used to walk
+// the stacks of many threads in parallel while the target is stopped. The
+// thread that runs a batch works on it too, so a pool of size 1 has no threads
+// of its own.
+//
+// Running a batch doesn't allocate: the calls are claimed from a shared
+// counter, and the function is passed by pointer.
+class WorkerPool {
+ public:
+  explicit WorkerPool(size_t size);
+  WorkerPool(const WorkerPool &other) = delete;
+  ~WorkerPool();
+
+  // The number of workers, including the thread that calls Run().
+  inline size_t size() const { return threads_.size() + 1; }
+
+  // The number of heap allocations made by the calls that ran on the threads
+  // of the pool, as counted by ThreadAllocations(). Calls made by the thread
+  // that calls Run() are counted for that thread.
+  inline uint64_t allocations() const {
+    return allocations_.load(std::memory_order_relaxed);
+  }
+
+  // Call fn(worker, i) for each i in [0, n), spread over the workers, where
+  // worker is the index in [0, size()) of the worker making the call; the
+  // thread that calls Run() is worker 0. Calls made by the same worker don't
+  // overlap. Returns once all of the calls have returned. fn must not throw.
+  template <typename F>
+  void Run(size_t n, const F &fn) {
+    RunBatch(n,
+             [](const void *fn, size_t worker, size_t i) {
+               (*static_cast<const F *>(fn))(worker, i);
+             },
+             &fn);
+  }
+
+ private:
+  typedef void (*call_t)(const void *, size_t, size_t);
+
+  std::vector<std::thread> threads_;
+
+  // The current batch. These are written with mutex_ held, before the batch is
+  // started.
+  call_t call_;
+  const void *fn_;
+  size_t n_;
+
+  std::atomic<size_t> next_;  // The next call to claim
+  std::mutex mutex_;
+  std::condition_variable start_;  // Signals a new batch, or stop_
+  std::condition_variable done_;   // Signals that busy_ reached zero
+  uint64_t batch_;                 // Number of batches started
+  size_t busy_;  // Threads of the pool still working on the current batch
+  bool stop_;
+  std::atomic<uint64_t> allocations_;
+
+  void RunBatch(size_t n, call_t call, const void *fn);
+
+  // Make calls of the current batch until there are none left.
+  void Work(size_t worker);
+
+  // The body of each of threads_.
+  void Loop(size_t worker);
+};
+}  // namespace pyflame
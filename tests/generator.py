@@ -0,0 +1,41 @@
+# Copyright 2018 Uber Technologies, Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+import os
+import sys
+import time
+
+
+def wait():
+    time.sleep(0.05)
+
+
+def waiter():
+    while True:
+        wait()
+        yield
+
+
+def main():
+    sys.stdout.write('%d\n' % (os.getpid(), ))
+    sys.stdout.flush()
+    # The generator is resumed from two different lines, while its own frame
+    # is at the same instruction each time.
+    gen = waiter()
+    while True:
+        next(gen)
+        next(gen)
+
+
+if __name__ == '__main__':
+    main()
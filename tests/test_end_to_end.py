@@ -19,6 +19,7 @@ import os
 import platform
 import pytest
 import re
+import signal
 import subprocess
 import sys
 import time
@@ -98,6 +99,18 @@ def threaded_dijkstra():
         yield p
 
 
+@pytest.yield_fixture
+def many_threads_dijkstra():
+    with python_proc('dijkstra.py', '-t', 32) as p:
+        yield p
+
+
+@pytest.yield_fixture
+def generator():
+    with python_proc('generator.py') as p:
+        yield p
+
+
 @pytest.yield_fixture
 def sleeper():
     with python_proc('sleeper.py') as p:
@@ -122,6 +135,12 @@ def threaded_busy():
         yield p
 
 
+@pytest.yield_fixture
+def many_threads_busy():
+    with python_proc('threaded_busy.py', 15) as p:
+        yield p
+
+
 @pytest.yield_fixture
 def exit_early():
     with python_proc('exit_early.py') as p:
@@ -618,6 +637,66 @@ def test_thread_dump(threaded_dijkstra):
     assert threads == 5
 
 
+@pytest.mark.skipif(MISSING_THREADS, reason='build does not have threads')
+@pytest.mark.parametrize('defer', [False, True])
+def test_walkers(many_threads_dijkstra, defer):
+    """Test walking the stacks of many threads in parallel."""
+    args = [path_to_pyflame(), '--threads', '--walkers=4', '--stats']
+    if defer:
+        args.append('--defer-symbols')
+    proc = subprocess.Popen(
+        args + ['-p', str(many_threads_dijkstra.pid)],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        universal_newlines=True)
+    out, err = communicate(proc)
+    assert proc.returncode == 0
+    lines = out.split('\n')
+    assert lines.pop(-1) == ''  # output should end in a newline
+    consume_unique(lines, allow_idle=True)
+
+    assert re.search(r'^  failed samples +0$', err, re.MULTILINE)
+    assert re.search(r'^  truncated stacks +0$', err, re.MULTILINE)
+
+
+@pytest.mark.parametrize('walkers', ['0', '65', 'x'])
+def test_invalid_walkers(dijkstra, walkers):
+    """Test that --walkers rejects a bad number of walkers."""
+    proc = subprocess.Popen(
+        [path_to_pyflame(), '--walkers=' + walkers, '-p',
+         str(dijkstra.pid)],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        universal_newlines=True)
+    out, err = communicate(proc)
+    assert not out
+    assert err.startswith('Invalid number of walkers')
+    assert proc.returncode == 1
+
+
+@pytest.mark.skipif(MISSING_THREADS, reason='build does not have threads')
+def test_resumed_generator(generator):
+    """Test that a generator's callers aren't copied from an earlier sample."""
+    proc = subprocess.Popen(
+        [path_to_pyflame(), '--threads', '-p',
+         str(generator.pid)],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        universal_newlines=True)
+    out, err = communicate(proc)
+    assert not err
+    assert proc.returncode == 0
+    lines = out.split('\n')
+    assert lines.pop(-1) == ''  # output should end in a newline
+    callers = set()
+    for line in assert_unique(lines):
+        stack = line.rsplit(' ', 1)[0].split(';')
+        if stack[-1].endswith(':wait:20'):
+            callers.add(os.path.basename(stack[-3]))
+    # The generator is resumed from each line of main() about equally often.
+    assert callers == {'generator.py:main:36', 'generator.py:main:37'}
+
+
 def test_no_line_numbers(dijkstra):
     """Basic test for --no-line-numbers"""
     proc = subprocess.Popen(
@@ -632,8 +711,483 @@ def test_no_line_numbers(dijkstra):
     lines = out.split('\n')
     assert lines.pop(-1) == ''  # output should end in a newline
 
-    # With no line numbers included there can be duplicate lines,
-    # but flamegraph.pl performs deduplication as well
+    # Frames are aggregated without their line numbers, so each stack should
+    # only be printed once.
+    consume_unique(
+        lines, allow_idle=True, line_re=FLAMEGRAPH_NONUMBER_RE)
+
+
+def test_bytecode_offsets(dijkstra):
+    """Basic test for --bytecode-offsets"""
+    proc = subprocess.Popen(
+        [path_to_pyflame(), '-p',
+         str(dijkstra.pid), '--bytecode-offsets'],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        universal_newlines=True)
+    out, err = communicate(proc)
+    assert not err
+    assert proc.returncode == 0
+    lines = out.split('\n')
+    assert lines.pop(-1) == ''  # output should end in a newline
+
+    # Offsets aren't line numbers, so skip the line number sanity checks done
+    # by assert_flamegraph().
+    assert len(lines) == len(set(lines))
     for line in lines:
-        assert_flamegraph(
-            line, allow_idle=True, line_re=FLAMEGRAPH_NONUMBER_RE)
+        assert IDLE_RE.match(line) or FLAMEGRAPH_RE.match(line)
+
+
+def test_max_depth(dijkstra):
+    """Test that --max-depth limits the number of frames in each stack."""
+    proc = subprocess.Popen(
+        [path_to_pyflame(), '--max-depth=2', '-p',
+         str(dijkstra.pid)],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        universal_newlines=True)
+    out, err = communicate(proc)
+    assert not err
+    assert proc.returncode == 0
+    lines = out.split('\n')
+    assert lines.pop(-1) == ''  # output should end in a newline
+    for line in assert_unique(lines, allow_idle=True):
+        if not IDLE_RE.match(line):
+            stack, _ = line.rsplit(' ', 1)
+            assert len(stack.split(';')) <= 2
+
+
+@pytest.mark.skipif(MISSING_THREADS, reason='build does not have threads')
+def test_nonstop(threaded_dijkstra):
+    """Test sampling a running process with --nonstop."""
+    proc = subprocess.Popen(
+        [path_to_pyflame(), '--nonstop', '--threads', '-p',
+         str(threaded_dijkstra.pid)],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        universal_newlines=True)
+    out, err = communicate(proc)
+    assert proc.returncode == 0
+    lines = out.split('\n')
+    assert lines.pop(-1) == ''  # output should end in a newline
+
+    # A stack that keeps changing while it's read is cut short, and a thread
+    # list that does is counted as failed; both are rare but possible.
+    lines = [
+        line for line in lines
+        if not line.startswith(('(failed) ', '(truncated)'))
+    ]
+    assert lines
+    consume_unique(lines, allow_idle=True)
+
+    # The process should still be running, and not stopped.
+    with open('/proc/%d/stat' % threaded_dijkstra.pid) as stat:
+        assert stat.read().rsplit(')', 1)[1].split()[0] in 'RS'
+
+
+def test_nonstop_exit_early(exit_early):
+    """Test that --nonstop notices when the process exits."""
+    proc = subprocess.Popen(
+        [path_to_pyflame(), '--nonstop', '-s', '10', '-p',
+         str(exit_early.pid)],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        universal_newlines=True)
+    start = time.time()
+    out, err = communicate(proc)
+    assert time.time() - start < 8
+    assert proc.returncode == 0
+    lines = out.split('\n')
+    assert lines.pop(-1) == ''  # output should end in a newline
+    lines = [
+        line for line in lines
+        if not line.startswith(('(failed) ', '(truncated)'))
+    ]
+    consume_unique(lines, allow_idle=True)
+
+
+def test_stats(dijkstra):
+    """Test that --stats prints a report to stderr."""
+    proc = subprocess.Popen(
+        [path_to_pyflame(), '--stats', '-p',
+         str(dijkstra.pid)],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        universal_newlines=True)
+    out, err = communicate(proc)
+    assert proc.returncode == 0
+    lines = out.split('\n')
+    assert lines.pop(-1) == ''  # output should end in a newline
+    consume_unique(lines, allow_idle=True)
+
+    assert err.startswith('pyflame stats:\n')
+    samples = re.search(r'^  samples +(\d+) ', err, re.MULTILINE)
+    assert samples is not None
+    assert int(samples.group(1)) > 0
+    # The aggregator thread easily keeps up with 100 samples per second.
+    assert re.search(r'^  dropped samples +0$', err, re.MULTILINE)
+    # The process is stopped while it's read, so every frame can be read.
+    assert re.search(r'^  truncated stacks +0$', err, re.MULTILINE)
+    assert 'target stop time per sample:' in err
+    assert 'walk time per thread:' in err
+
+
+def check_steady_state_allocations(pid, args):
+    args = [path_to_pyflame(), '--stats', '-s', '2'] + args
+    proc = subprocess.Popen(
+        args + ['-p', str(pid)],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        universal_newlines=True)
+    out, err = communicate(proc)
+    assert proc.returncode == 0
+    samples = int(re.search(r'^  samples +(\d+) ', err, re.MULTILINE).group(1))
+    assert samples > 0
+    allocations = re.search(
+        r'^  allocations +(\d+)(?: \(on \d+ ticks, the last by sample '
+        r'(\d+)\))?$', err, re.MULTILINE)
+    assert allocations is not None
+    # The first samples grow the buffers that the rest reuse. Without
+    # --threads, the two threads take turns holding the GIL, so each one is
+    # missing from about half of the samples.
+    if allocations.group(2) is not None:
+        assert int(allocations.group(2)) <= samples // 2
+
+
+@pytest.mark.parametrize('threads', [False, True])
+def test_steady_state_allocations(threaded_busy, threads):
+    """Test that sampling stops allocating memory once it has warmed up."""
+    check_steady_state_allocations(threaded_busy.pid,
+                                   ['--threads'] if threads else [])
+
+
+@pytest.mark.skipif(MISSING_THREADS, reason='build does not have threads')
+def test_steady_state_allocations_walkers(many_threads_busy):
+    """Test that walking stacks in parallel stops allocating too."""
+    check_steady_state_allocations(many_threads_busy.pid,
+                                   ['--threads', '--walkers=4'])
+
+
+@pytest.mark.parametrize('jitter', [False, True])
+def test_sample_schedule(dijkstra, jitter):
+    """Test that samples plus missed ticks add up to the requested rate."""
+    args = [path_to_pyflame(), '--stats', '-s', '1', '-r', '0.01']
+    if jitter:
+        args.append('--jitter')
+    proc = subprocess.Popen(
+        args + ['-p', str(dijkstra.pid)],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        universal_newlines=True)
+    out, err = communicate(proc)
+    assert proc.returncode == 0
+    samples = re.search(r'^  samples +(\d+) ', err, re.MULTILINE)
+    missed = re.search(r'^  missed ticks +(\d+)$', err, re.MULTILINE)
+    ticks = int(samples.group(1)) + int(missed.group(1))
+    if jitter:
+        # The number of samples in a Poisson process with a mean of 100 is
+        # within 70 and 130 with overwhelming probability.
+        assert 70 <= ticks <= 130
+    else:
+        assert 95 <= ticks <= 101
+
+
+def test_overhead_budget(dijkstra):
+    """Test that samples are weighted when the rate follows a budget."""
+    proc = subprocess.Popen(
+        [path_to_pyflame(), '--overhead-budget=0.5', '--stats', '-r', '0.0005',
+         '-p', str(dijkstra.pid)],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        universal_newlines=True)
+    out, err = communicate(proc)
+    assert proc.returncode == 0
+    lines = out.split('\n')
+    assert lines.pop(-1) == ''  # output should end in a newline
+    total = 0
+    for line in assert_unique(lines, allow_idle=True):
+        total += int(line.rsplit(' ', 1)[1])
+
+    samples = re.search(r'^  samples +(\d+) ', err, re.MULTILINE)
+    weighted = re.search(r'^  weighted samples +(\d+)$', err, re.MULTILINE)
+    assert total == int(weighted.group(1))
+    assert int(weighted.group(1)) >= int(samples.group(1))
+
+
+def test_multiple_pids(dijkstra, sleeper):
+    """Test that stacks from several processes are merged."""
+    proc = subprocess.Popen(
+        [
+            path_to_pyflame(), '-p',
+            str(dijkstra.pid), '-p',
+            str(sleeper.pid)
+        ],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        universal_newlines=True)
+    out, err = communicate(proc)
+    assert not err
+    assert proc.returncode == 0
+    assert 'dijkstra.py' in out
+    assert 'sleeper.py' in out
+    lines = out.split('\n')
+    assert lines.pop(-1) == ''  # output should end in a newline
+    consume_unique(lines, allow_idle=True)
+
+
+def test_per_pid(dijkstra, sleeper):
+    """Test that --per-pid puts each process under its own root frame."""
+    proc = subprocess.Popen(
+        [
+            path_to_pyflame(), '--per-pid', '-p',
+            str(dijkstra.pid), '-p',
+            str(sleeper.pid)
+        ],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        universal_newlines=True)
+    out, err = communicate(proc)
+    assert not err
+    assert proc.returncode == 0
+    lines = out.split('\n')
+    assert lines.pop(-1) == ''  # output should end in a newline
+    stacks = {dijkstra.pid: [], sleeper.pid: []}
+    for line in lines:
+        m = re.match(r'^\(pid (\d+)\);(.*)$', line)
+        assert m is not None, 'line {!r} did not match!'.format(line)
+        stacks[int(m.group(1))].append(m.group(2))
+    assert any('dijkstra.py' in line for line in stacks[dijkstra.pid])
+    assert not any('sleeper.py' in line for line in stacks[dijkstra.pid])
+    assert any('sleeper.py' in line for line in stacks[sleeper.pid])
+    for pid_lines in stacks.values():
+        consume_unique(pid_lines, allow_idle=True)
+
+
+def test_pids_from(dijkstra, exit_early, tmpdir):
+    """Test that the other processes are still sampled after one exits."""
+    pids = tmpdir.join('pids')
+    pids.write('%d\n%d\n' % (dijkstra.pid, exit_early.pid))
+    proc = subprocess.Popen(
+        [
+            path_to_pyflame(), '--per-pid', '-s', '4', '--pids-from',
+            str(pids)
+        ],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        universal_newlines=True)
+    start = time.time()
+    out, err = communicate(proc)
+    assert time.time() - start >= 3.5
+    assert not err
+    assert proc.returncode == 0
+    counts = {dijkstra.pid: 0, exit_early.pid: 0}
+    for line in out.split('\n')[:-1]:
+        m = re.match(r'^\(pid (\d+)\);.* (\d+)$', line)
+        assert m is not None, 'line {!r} did not match!'.format(line)
+        counts[int(m.group(1))] += int(m.group(2))
+    # The process that exits early is only sampled for about two seconds.
+    assert counts[exit_early.pid] < counts[dijkstra.pid]
+
+
+@pytest.mark.parametrize('wrapper', [[], ['sh', '-c', '"$0" "$@"; true']])
+def test_follow_forks(wrapper):
+    """Test that --follow-forks profiles the processes that are forked."""
+    proc = subprocess.Popen(
+        [path_to_pyflame(), '--follow-forks', '-t'] + wrapper +
+        [sys.executable, 'tests/forker.py'],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        universal_newlines=True)
+    out, err = communicate(proc)
+    assert not err
+    assert proc.returncode == 0
+    lines = out.split('\n')
+    assert lines.pop(-1) == ''  # output should end in a newline
+    stacks = {}
+    for line in lines:
+        m = re.match(r'^\(pid (\d+)\);(.*)$', line)
+        assert m is not None, 'line {!r} did not match!'.format(line)
+        stacks.setdefault(int(m.group(1)), []).append(m.group(2))
+    # forker.py runs a chain of six processes after the first one.
+    assert len(stacks) >= 4
+    spawned = [
+        pid for pid, pid_lines in stacks.items()
+        if any(':spawn:' in line for line in pid_lines)
+    ]
+    assert len(spawned) >= 3
+    for pid_lines in stacks.values():
+        consume_unique(pid_lines, allow_idle=True)
+
+
+@pytest.mark.parametrize('retain', [None, 2])
+def test_window(tmpdir, retain):
+    """Test writing the profile to a new file for each window."""
+    args = [path_to_pyflame(), '--window=0.3s', '--output-dir', str(tmpdir)]
+    if retain is not None:
+        args.append('--retain=%d' % retain)
+    proc = subprocess.Popen(
+        args + ['-t', sys.executable, 'tests/sleeper.py', '-t', '2'],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        universal_newlines=True)
+    out, err = communicate(proc)
+    assert not err
+    assert out.strip().isdigit()  # only the PID printed by sleeper.py
+    assert proc.returncode == 0
+    names = sorted(path.basename for path in tmpdir.listdir())
+    for name in names:
+        assert re.match(r'^pyflame-\d{8}T\d{6}\.\d{3}Z\.txt$', name)
+    if retain is None:
+        assert len(names) >= 4
+    else:
+        assert len(names) == retain
+    for name in names:
+        lines = tmpdir.join(name).read().split('\n')
+        assert lines.pop(-1) == ''  # output should end in a newline
+        total = 0
+        for line in lines:
+            assert_flamegraph(line, allow_idle=True)
+            total += int(line.rsplit(' ', 1)[1])
+        # Each window only has the samples taken during it, about 30.
+        assert total <= 45
+
+
+def test_window_requires_output_dir():
+    """Test that --window can't be used without --output-dir."""
+    proc = subprocess.Popen(
+        [path_to_pyflame(), '--window=60s', '-t', sys.executable, '-V'],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        universal_newlines=True)
+    out, err = communicate(proc)
+    assert 'requires --output-dir' in err
+    assert proc.returncode == 1
+
+
+def tracer_pid(pid):
+    """Get the PID of the process tracing pid, or 0 if it isn't traced."""
+    with open('/proc/%d/status' % pid) as status:
+        for line in status:
+            if line.startswith('TracerPid:'):
+                return int(line.split()[1])
+
+
+@pytest.mark.parametrize('signum', [signal.SIGINT, signal.SIGTERM])
+def test_signal_flush(dijkstra, signum):
+    """Test that the profile is written when pyflame is interrupted."""
+    proc = subprocess.Popen(
+        [path_to_pyflame(), '-s', '60', '-p', str(dijkstra.pid)],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        universal_newlines=True)
+    time.sleep(1)
+    proc.send_signal(signum)
+    start = time.time()
+    out, err = communicate(proc)
+    assert time.time() - start < 5
+    assert not err
+    assert proc.returncode == 0
+    lines = out.split('\n')
+    assert lines.pop(-1) == ''  # output should end in a newline
+    consume_unique(lines, allow_idle=True)
+    # The process was detached, and keeps running.
+    assert dijkstra.poll() is None
+    assert tracer_pid(dijkstra.pid) == 0
+
+
+def test_snapshot(dijkstra, tmpdir):
+    """Test that SIGUSR1 writes a snapshot of the profile so far."""
+    output = tmpdir.join('profile.txt')
+    proc = subprocess.Popen(
+        [
+            path_to_pyflame(), '-s', '60', '-o',
+            str(output), '-p',
+            str(dijkstra.pid)
+        ],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        universal_newlines=True)
+
+    def count_samples():
+        lines = output.read().split('\n')
+        assert lines.pop(-1) == ''  # output should end in a newline
+        consume_unique(list(lines), allow_idle=True)
+        return sum(int(line.rsplit(' ', 1)[1]) for line in lines)
+
+    time.sleep(1)
+    proc.send_signal(signal.SIGUSR1)
+    time.sleep(0.5)
+    first = count_samples()
+    assert first > 0
+    proc.send_signal(signal.SIGUSR1)
+    time.sleep(0.5)
+    second = count_samples()
+    # Each snapshot replaces the previous one, with all of the samples so far.
+    assert second > first
+    proc.send_signal(signal.SIGTERM)
+    out, err = communicate(proc)
+    assert not out
+    assert not err
+    assert proc.returncode == 0
+    assert count_samples() >= second
+
+
+def test_snapshot_stdout(dijkstra):
+    """Test that SIGUSR1 is ignored when the profile goes to stdout."""
+    proc = subprocess.Popen(
+        [path_to_pyflame(), '-s', '60', '-p',
+         str(dijkstra.pid)],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        universal_newlines=True)
+    time.sleep(1)
+    proc.send_signal(signal.SIGUSR1)
+    time.sleep(0.5)
+    proc.send_signal(signal.SIGTERM)
+    out, err = communicate(proc)
+    assert not err
+    assert proc.returncode == 0
+    lines = out.split('\n')
+    assert lines.pop(-1) == ''  # output should end in a newline
+    # Only the final profile is written, so each stack appears once.
+    consume_unique(lines, allow_idle=True)
+
+
+@pytest.mark.parametrize('flags,line_re', [
+    ([], FLAMEGRAPH_RE),
+    (['--no-line-numbers'], FLAMEGRAPH_NONUMBER_RE),
+])
+def test_defer_symbols(dijkstra, flags, line_re):
+    """Test decoding frames after the process is continued."""
+    proc = subprocess.Popen(
+        [path_to_pyflame(), '--defer-symbols', '-p',
+         str(dijkstra.pid)] + flags,
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        universal_newlines=True)
+    out, err = communicate(proc)
+    assert not err
+    assert proc.returncode == 0
+    lines = out.split('\n')
+    assert lines.pop(-1) == ''  # output should end in a newline
+    consume_unique(lines, allow_idle=True, line_re=line_re)
+    assert any(':run_times' in line for line in lines)
+
+
+def test_defer_symbols_sleeper(sleeper):
+    """Test that deferred frames get the same lines as decoding them at once."""
+    stacks = []
+    for flags in [[], ['--defer-symbols']]:
+        proc = subprocess.Popen(
+            [path_to_pyflame(), '-x', '-p',
+             str(sleeper.pid)] + flags,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE,
+            universal_newlines=True)
+        out, err = communicate(proc)
+        assert not err
+        assert proc.returncode == 0
+        stacks.append(set(line.rsplit(' ', 1)[0] for line in out.split('\n')
+                          if line))
+    # sleeper.py spends almost all of its time at the same line.
+    assert stacks[0] & stacks[1]
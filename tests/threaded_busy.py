@@ -23,10 +23,14 @@ def do_sleep():
 
 
 def main():
+    # The threads are started before the PID is written, so that they all
+    # exist by the time they're profiled.
+    threads = int(sys.argv[1]) if len(sys.argv) > 1 else 1
+    for _ in range(threads):
+        thread = threading.Thread(target=do_sleep)
+        thread.start()
     sys.stdout.write('%d\n' % (os.getpid(), ))
     sys.stdout.flush()
-    thread = threading.Thread(target=do_sleep)
-    thread.start()
     do_sleep()
 
 